@@ -34,6 +34,27 @@ static u16 curr_handler = 0;
 static u16 prev_handler = 0;
 #endif
 
+/*
+ * CPUID, RDTSC, RDTSCP and XSETBV are handled right in __vmx_entrypoint
+ * (see vmx.{S,asm}) without going through vcpu_handle_exit(), unless the
+ * guest is single-stepping or in an interrupt shadow, an event is pending
+ * injection or EPT updates are left to invalidate (vcpu->ept_gen isn't
+ * *vcpu->ept_gen_ptr anymore), which vcpu_handle_exit() takes care of.  The
+ * rest of what it does on each exit can't be skipped, so it's off for
+ * nesting (the nested hypervisor may want those exits), per-exit statistics
+ * and tracing.
+ *
+ * The offsets below are what the assembly needs to look at the vCPU.
+ */
+#if defined(NESTED_VMX) || defined(ENABLE_STATS) || defined(ENABLE_TRACE)
+const u8 vcpu_fast_exits = 0;
+#else
+const u8 vcpu_fast_exits = 1;
+#endif
+const u32 vcpu_fast_irq_off = offsetof(struct vcpu, irq.pending);
+const u32 vcpu_fast_gen_off = offsetof(struct vcpu, ept_gen);
+const u32 vcpu_fast_gen_ptr_off = offsetof(struct vcpu, ept_gen_ptr);
+
 #ifdef NESTED_VMX
 /* FIXME:  Support these!  */
 static const u32 nested_unsupported_primary = CPU_BASED_MOV_DR_EXITING;
@@ -228,13 +249,13 @@ static inline void vcpu_inject_irq(struct vcpu *vcpu, u32 instr_len, u16 intr_ty
 
 static inline void vcpu_inject_hardirq_noerr(struct vcpu *vcpu, u8 vector)
 {
-	return vcpu_inject_irq(vcpu, vmcs_read32(VM_EXIT_INSTRUCTION_LEN),
+	return vcpu_inject_irq(vcpu, vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN),
 			       INTR_TYPE_HARD_EXCEPTION, vector, false, 0);
 }
 
 static inline void vcpu_inject_hardirq(struct vcpu *vcpu, u8 vector, u32 err)
 {
-	return vcpu_inject_irq(vcpu, vmcs_read32(VM_EXIT_INSTRUCTION_LEN),
+	return vcpu_inject_irq(vcpu, vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN),
 			       INTR_TYPE_HARD_EXCEPTION, vector, true, err);
 }
 
@@ -255,7 +276,7 @@ static inline bool vcpu_inject_gp_if(struct vcpu *vcpu, bool cond)
 
 static inline void vcpu_advance_rip(struct vcpu *vcpu)
 {
-	if (vcpu->eflags & X86_EFLAGS_TF) {
+	if (vcpu_rflags(vcpu) & X86_EFLAGS_TF) {
 		vcpu_inject_hardirq_noerr(vcpu, X86_TRAP_DB);
 		if (vcpu_probe_cpl(0)) {
 			__writedr(6, __readdr(6) | DR6_BS | DR6_RTM);
@@ -266,12 +287,13 @@ static inline void vcpu_advance_rip(struct vcpu *vcpu)
 		}
 	}
 
-	u32 instr_len = vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
-	vmcs_write(GUEST_RIP, vcpu->ip + instr_len);
+	u32 instr_len = vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN);
+	vcpu_vmcs_write(vcpu, GUEST_RIP, vcpu_rip(vcpu) + instr_len);
 
-	size_t interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
-	vmcs_write32(GUEST_INTERRUPTIBILITY_INFO,
-		   interruptibility & ~(GUEST_INTR_STATE_MOV_SS | GUEST_INTR_STATE_STI));
+	/* Mostly 0 already, in which case this writes nothing back.  */
+	u32 interruptibility = vcpu_vmcs_read32(vcpu, GUEST_INTERRUPTIBILITY_INFO);
+	vcpu_vmcs_write(vcpu, GUEST_INTERRUPTIBILITY_INFO,
+			interruptibility & ~(GUEST_INTR_STATE_MOV_SS | GUEST_INTR_STATE_STI));
 }
 
 #ifdef NESTED_VMX
@@ -297,13 +319,13 @@ static inline bool nested_inject_ve(struct vcpu *vcpu)
 	if (!gpa_to_hpa(vcpu, ve_info_addr, &hpa))
 		return false;
 
-	struct ve_except_info *info = mm_remap(hpa, PAGE_SIZE);
+	struct ve_except_info *info = vcpu_map_page(vcpu, hpa);
 	if (!info)
 		return false;
 
 	if (info->except_mask == 0) {
 		KSM_DEBUG("Trying to inject #VE but guest opted-out.\n");
-		mm_unmap(info, PAGE_SIZE);
+		vcpu_unmap_page(vcpu, info);
 		return false;
 	}
 
@@ -311,10 +333,10 @@ static inline bool nested_inject_ve(struct vcpu *vcpu)
 	info->eptp = __nested_vmcs_read16(vmcs, EPTP_INDEX);
 	info->except_mask = (u32)~0UL;
 	info->reason = EXIT_REASON_EPT_VIOLATION;
-	info->gpa = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
-	info->gla = vmcs_read(GUEST_LINEAR_ADDRESS);
-	info->exit = vmcs_read(EXIT_QUALIFICATION);
-	mm_unmap(info, PAGE_SIZE);
+	info->gpa = vcpu_vmcs_read64(vcpu, GUEST_PHYSICAL_ADDRESS);
+	info->gla = vcpu_vmcs_read(vcpu, GUEST_LINEAR_ADDRESS);
+	info->exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	vcpu_unmap_page(vcpu, info);
 	vcpu_inject_hardirq_noerr(vcpu, X86_TRAP_VE);
 	return true;
 }
@@ -322,7 +344,6 @@ static inline bool nested_inject_ve(struct vcpu *vcpu)
 
 static bool vcpu_nop(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
 	KSM_DEBUG_RAW("you need to handle the corresponding VM-exit for the handler you set.\n");
 	KSM_PANIC(KSM_PANIC_CODE, VCPU_BUG_UNHANDLED, curr_handler, prev_handler);
 	return false;
@@ -330,41 +351,35 @@ static bool vcpu_nop(struct vcpu *vcpu)
 
 static bool vcpu_handle_except_nmi(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
-	u32 intr_info = vmcs_read32(VM_EXIT_INTR_INFO);
+	u32 intr_info = vcpu_vmcs_read32(vcpu, VM_EXIT_INTR_INFO);
 	u32 intr_type = intr_info & INTR_INFO_INTR_TYPE_MASK;
 	u8 vector = intr_info & INTR_INFO_VECTOR_MASK;
 
 	u32 instr_len = 0;
 	if (intr_type & INTR_TYPE_HARD_EXCEPTION && vector == X86_TRAP_PF)
-		__writecr2(vmcs_read(EXIT_QUALIFICATION));
+		__writecr2(vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION));
 	else
-		instr_len = vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
+		instr_len = vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN);
 
 	bool has_err = intr_info & INTR_INFO_DELIVER_CODE_MASK;
 	u32 err = vmcs_read32(IDT_VECTORING_ERROR_CODE);
 	vcpu_inject_irq(vcpu, instr_len, intr_type, vector, has_err, err);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_triplefault(struct vcpu *vcpu)
 {
 	/* A triple fault occured during handling of a double fault in guest, bug check.  */
-	VCPU_TRACER_START();
 	KSM_PANIC(KSM_PANIC_CODE, VCPU_TRIPLEFAULT, curr_handler, prev_handler);
-	VCPU_TRACER_END();
 	return false;
 }
 
 static bool vcpu_handle_taskswitch(struct vcpu *vcpu)
 {
 	/* Not really called  */
-	VCPU_TRACER_START();
 
-	uintptr_t exit = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	u16 selector = (u16)exit;
 	u8 src = (exit >> 30) & 3;
 	const char *name;
@@ -390,14 +405,12 @@ static bool vcpu_handle_taskswitch(struct vcpu *vcpu)
 
 	KSM_DEBUG("switching through %s (selector: %d => table: %s index: %d)\n",
 		   name, selector, table, selector >> 3);
-	VCPU_TRACER_END();
 	return true;
 }
 
+/* Keep in sync with the fast path in vmx.{S,asm}.  */
 static bool vcpu_handle_cpuid(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	int cpuid[4];
 	int func = ksm_read_reg32(vcpu, REG_AX);
 	int subf = ksm_read_reg32(vcpu, REG_CX);
@@ -414,51 +427,41 @@ static bool vcpu_handle_cpuid(struct vcpu *vcpu)
 	ksm_write_reg32(vcpu, REG_DX, cpuid[3]);
 	vcpu_advance_rip(vcpu);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_hlt(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
 	__halt();
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_invd(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
 	__invd();
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_invlpg(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
-	uintptr_t addr = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t addr = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	__invlpg((void *)addr);
 	__invvpid_addr(vpid_nr(), addr);
+	vcpu_flush_gtlb_addr(vcpu, addr);
 	vcpu_advance_rip(vcpu);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_rdtsc(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	u64 tsc = __rdtsc();
 	ksm_write_reg32(vcpu, REG_AX, tsc);
 	ksm_write_reg32(vcpu, REG_DX, tsc >> 32);
 	vcpu_advance_rip(vcpu);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
@@ -469,12 +472,10 @@ static bool vcpu_handle_vmfunc(struct vcpu *vcpu)
 	 *	1) funciton is not supported
 	 *	2) EPTP index is too high.
 	 */
-	VCPU_TRACER_START();
 	KSM_DEBUG("vmfunc caused VM-exit!  func is %d eptp index is %d\n",
 		   ksm_read_reg32(vcpu, REG_AX), ksm_read_reg32(vcpu, REG_CX));
 	vcpu_inject_hardirq_noerr(vcpu, X86_TRAP_UD);
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END()
 	return true;
 }
 
@@ -494,7 +495,7 @@ static bool vcpu_dump_pml(struct vcpu *vcpu)
 		pml_index++;
 
 	/* Dump it...  */
-	struct ept *ept = &vcpu->ept;
+	struct ept *ept = vcpu_ept(vcpu);
 	u16 eptp = vcpu_eptp_idx(vcpu);
 	for (; pml_index < PML_MAX_ENTRIES; ++pml_index) {
 		/* CPU guarantees that the lower 12 bits (the offset) are always 0.  */
@@ -504,7 +505,8 @@ static bool vcpu_dump_pml(struct vcpu *vcpu)
 
 		/* Reset AD bits now otherwise we probably won't get this page again  */
 		u64 *epte = ept_pte(EPT4(ept, eptp), gpa);
-		*epte &= ~(EPT_ACCESSED | EPT_DIRTY);
+		if (epte)
+			*epte &= ~(EPT_ACCESSED | EPT_DIRTY);
 	}
 
 	/* Reset the PML index now...  */
@@ -512,7 +514,7 @@ static bool vcpu_dump_pml(struct vcpu *vcpu)
 	/* We're done here  */
 	KSM_DEBUG_RAW("PML dump done\n");
 	/* We definitely modified AD bits  */
-	__invept_all();
+	vcpu_invept_view(vcpu, eptp);
 	return true;
 }
 #endif
@@ -531,14 +533,16 @@ static bool vcpu_handle_pml_full(struct vcpu *vcpu)
 
 static inline void vcpu_vm_succeed(struct vcpu *vcpu)
 {
-	vcpu->eflags &= ~(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF |
-			  X86_EFLAGS_ZF | X86_EFLAGS_SF | X86_EFLAGS_OF);
+	vcpu_set_rflags(vcpu, vcpu_rflags(vcpu) &
+			~(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF |
+			  X86_EFLAGS_ZF | X86_EFLAGS_SF | X86_EFLAGS_OF));
 }
 
 static inline void vcpu_vm_fail_invalid(struct vcpu *vcpu)
 {
-	vcpu->eflags |= X86_EFLAGS_CF;
-	vcpu->eflags &= ~(X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_ZF | X86_EFLAGS_SF | X86_EFLAGS_OF);
+	uintptr_t rflags = vcpu_rflags(vcpu) | X86_EFLAGS_CF;
+	rflags &= ~(X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_ZF | X86_EFLAGS_SF | X86_EFLAGS_OF);
+	vcpu_set_rflags(vcpu, rflags);
 }
 
 #ifdef NESTED_VMX
@@ -548,8 +552,9 @@ static inline void vcpu_vm_fail_valid(struct vcpu *vcpu, size_t err)
 	if (nested_has_vmcs(nested))
 		__nested_vmcs_write(nested->vmcs, VM_INSTRUCTION_ERROR, err);
 
-	vcpu->eflags |= X86_EFLAGS_ZF;
-	vcpu->eflags &= ~(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_SF | X86_EFLAGS_OF);
+	uintptr_t rflags = vcpu_rflags(vcpu) | X86_EFLAGS_ZF;
+	rflags &= ~(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_SF | X86_EFLAGS_OF);
+	vcpu_set_rflags(vcpu, rflags);
 }
 #endif
 
@@ -572,7 +577,7 @@ static inline void vcpu_do_exit(struct vcpu *vcpu)
 	/* Fix IDT (restore whatever guest last loaded...)  */
 	__lidt(&vcpu->g_idt);
 
-	uintptr_t ret = vcpu->ip + vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
+	uintptr_t ret = vcpu_rip(vcpu) + vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN);
 	vcpu_vm_succeed(vcpu);
 
 	uintptr_t cr3 = vmcs_read(GUEST_CR3);
@@ -581,28 +586,44 @@ static inline void vcpu_do_exit(struct vcpu *vcpu)
 	/* See __vmx_entrypoint in assembly on how this is used.  */
 	ksm_write_reg(vcpu, REG_CX, ret);
 	ksm_write_reg(vcpu, REG_DX, ksm_read_reg(vcpu, REG_SP));
-	ksm_write_reg(vcpu, REG_AX, vcpu->eflags);
+	ksm_write_reg(vcpu, REG_AX, vcpu_rflags(vcpu));
 }
 
 #ifdef EPAGE_HOOK
 static bool vcpu_handle_hook(struct vcpu *vcpu, struct page_hook_info *h)
 {
 	KSM_DEBUG("page hook request for %p => %p (%p)\n", h->dpa, h->cpa, h->c_va);
-	h->ops->init_eptp(h, &vcpu->ept);
+	h->ops->init_eptp(h, vcpu_ept(vcpu));
+	__invvpid_all();
+	vcpu_invept(vcpu);
 	return true;
 }
 
 static inline bool vcpu_handle_unhook(struct vcpu *vcpu, uintptr_t dpa)
 {
-	struct ept *ept = &vcpu->ept;
+	struct ept *ept = vcpu_ept(vcpu);
 	KSM_DEBUG("unhook page %p\n", dpa);
-	for_each_eptp(i)
-		ept_alloc_page(EPT4(ept, i), EPT_ACCESS_ALL, dpa, dpa);
-	__invept_all();
+	for_each_eptp(ept, i)
+		ept_alloc_page(ept, i, EPT_ACCESS_ALL, dpa, dpa);
+	vcpu_invept(vcpu);
 	return true;
 }
 #endif
 
+static inline bool vcpu_handle_ar_range(struct vcpu *vcpu, const struct ept_ar_batch *b)
+{
+	int skipped;
+	int changed = ept_set_ar_range(vcpu_ept(vcpu), b->ops, b->count, &skipped);
+
+	/* Whatever was applied before it failed still needs invalidating.  */
+	vcpu_invept(vcpu);
+	if (changed < 0)
+		return false;
+
+	KSM_DEBUG("access changed on %d pages, %d not mapped\n", changed, skipped);
+	return true;
+}
+
 static inline void vcpu_flush_idt(struct vcpu *vcpu)
 {
 	vmcs_write32(GUEST_IDTR_LIMIT, vcpu->idt.limit);
@@ -632,7 +653,7 @@ static inline bool vcpu_unhook_idte(struct vcpu *vcpu, struct shadow_idt_entry *
 static inline bool vcpu_emulate_vmfunc(struct vcpu *vcpu, struct h_vmfunc *vmfunc)
 {
 	/* Emulate a VMFUNC due it to not being supported natively.  */
-	struct ept *ept = &vcpu->ept;
+	struct ept *ept = vcpu_ept(vcpu);
 	if (vmfunc->func >= 64 || !(vcpu->vm_func_ctl & (1ULL << vmfunc->func)) ||
 	   (vmfunc->func == 0 && !test_bit(vmfunc->eptp,
 					   (volatile const unsigned long *)&ept->ptr_list[0]))) {
@@ -776,6 +797,9 @@ static inline bool nested_prepare_hypervisor(struct vcpu *vcpu, uintptr_t vmcs)
 	struct ksm *k = vcpu_to_ksm(vcpu);
 	u8 err = 0;
 
+	/* We're replacing the whole guest state below.  */
+	vcpu_vmcs_sync(vcpu);
+
 	err |= vmcs_write(GUEST_RIP, __nested_vmcs_read(vmcs, HOST_RIP));
 	err |= vmcs_write(GUEST_RSP, __nested_vmcs_read(vmcs, HOST_RSP));
 	err |= vmcs_write(GUEST_RFLAGS, X86_EFLAGS_FIXED);
@@ -888,28 +912,26 @@ static inline bool vcpu_enter_nested_hypervisor(struct vcpu *vcpu, u32 exit_reas
 		;/* FIXME  */
 
 	const u32 intr_mask = INTR_INFO_DELIVER_CODE_MASK | INTR_INFO_VALID_MASK;
-	u32 intr_info = vmcs_read32(VM_EXIT_INTR_INFO);
+	u32 intr_info = vcpu_vmcs_read32(vcpu, VM_EXIT_INTR_INFO);
 	if ((intr_info & intr_mask) == intr_mask)
 		nested_save(vmcs, VM_EXIT_INTR_ERROR_CODE);
 
 	__nested_vmcs_write(vmcs, VM_EXIT_REASON, exit_reason);
 	__nested_vmcs_write(vmcs, VM_EXIT_INTR_INFO, intr_info);
-	__nested_vmcs_write(vmcs, EXIT_QUALIFICATION, vmcs_read(EXIT_QUALIFICATION));
-	__nested_vmcs_write(vmcs, VM_EXIT_INSTRUCTION_LEN, vmcs_read32(VM_EXIT_INSTRUCTION_LEN));
+	__nested_vmcs_write(vmcs, EXIT_QUALIFICATION, vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION));
+	__nested_vmcs_write(vmcs, VM_EXIT_INSTRUCTION_LEN, vcpu_vmcs_read32(vcpu, VM_EXIT_INSTRUCTION_LEN));
 	if (handler == EXIT_REASON_GDT_IDT_ACCESS || handler == EXIT_REASON_LDT_TR_ACCESS ||
 	   (handler >= EXIT_REASON_VMCLEAR && handler <= EXIT_REASON_VMON))
-		__nested_vmcs_write(vmcs, VMX_INSTRUCTION_INFO, vmcs_read(VMX_INSTRUCTION_INFO));
+		__nested_vmcs_write(vmcs, VMX_INSTRUCTION_INFO, vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO));
 
-	__nested_vmcs_write(vmcs, GUEST_LINEAR_ADDRESS, vmcs_read(GUEST_LINEAR_ADDRESS));
-	__nested_vmcs_write64(vmcs, GUEST_PHYSICAL_ADDRESS, vmcs_read64(GUEST_PHYSICAL_ADDRESS));
+	__nested_vmcs_write(vmcs, GUEST_LINEAR_ADDRESS, vcpu_vmcs_read(vcpu, GUEST_LINEAR_ADDRESS));
+	__nested_vmcs_write64(vmcs, GUEST_PHYSICAL_ADDRESS, vcpu_vmcs_read64(vcpu, GUEST_PHYSICAL_ADDRESS));
 	return true;
 }
 #endif
 
 static bool vcpu_handle_vmcall(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	/* VMFUNC does not have CPL checks, so emulator shouldn't have too...  */
 	uint8_t nr = ksm_read_reg32(vcpu, REG_CX);
 	if (nr != HYPERCALL_VMFUNC && vcpu_inject_gp_if(vcpu, !vcpu_probe_cpl(0)))
@@ -919,7 +941,6 @@ static bool vcpu_handle_vmcall(struct vcpu *vcpu)
 	switch (nr) {
 	case HYPERCALL_STOP:
 		vcpu_do_exit(vcpu);
-		VCPU_TRACER_END();
 		return false;
 	case HYPERCALL_IDT:
 		vcpu_adjust_rflags(vcpu, vcpu_hook_idte(vcpu, (struct shadow_idt_entry *)arg));
@@ -942,7 +963,31 @@ static bool vcpu_handle_vmcall(struct vcpu *vcpu)
 	case HYPERCALL_SA_TASK:
 		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_vmcall(vcpu, arg));
 		break;
+	case HYPERCALL_SA_NEW:
+		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_new(vcpu, arg));
+		break;
+	case HYPERCALL_SA_FREE:
+		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_free(vcpu, arg));
+		break;
+	case HYPERCALL_SA_SNAP:
+		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_snap(vcpu, arg));
+		break;
+	case HYPERCALL_SA_RESET:
+		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_reset(vcpu, arg));
+		break;
+	case HYPERCALL_SA_DEDUP:
+		vcpu_adjust_rflags(vcpu, ksm_sandbox_handle_dedup(vcpu, arg));
+		break;
+#endif
+#ifdef SHARED_EPT
+	case HYPERCALL_INVEPT:
+		vcpu_invept(vcpu);
+		vcpu_adjust_rflags(vcpu, true);
+		break;
 #endif
+	case HYPERCALL_AR_RANGE:
+		vcpu_adjust_rflags(vcpu, vcpu_handle_ar_range(vcpu, (struct ept_ar_batch *)arg));
+		break;
 	default:
 		KSM_DEBUG("unsupported hypercall: %d\n", nr);
 		vcpu_inject_hardirq_noerr(vcpu, X86_TRAP_UD);
@@ -951,7 +996,6 @@ static bool vcpu_handle_vmcall(struct vcpu *vcpu)
 
 out:
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
@@ -1033,6 +1077,8 @@ static bool prepare_nested_guest(struct vcpu *vcpu, uintptr_t vmcs)
 	u64 cr4_read_shadow = __nested_vmcs_read(vmcs, CR4_READ_SHADOW) &
 		~vcpu->cr4_guest_host_mask;
 
+	/* We're replacing the whole guest state below.  */
+	vcpu_vmcs_sync(vcpu);
 	err |= nested_copy(vmcs, GUEST_RIP);
 	err |= nested_copy(vmcs, GUEST_RSP);
 	err |= nested_copy(vmcs, GUEST_RFLAGS);
@@ -1282,8 +1328,8 @@ static bool vcpu_handle_vmclear(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu))
 		goto out;
 
-	uintptr_t disp = vmcs_read(EXIT_QUALIFICATION);
-	u32 inst = vmcs_read32(VMX_INSTRUCTION_INFO);
+	uintptr_t disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u32 inst = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_read_vmx_addr(vcpu, gva, &gpa) ||
 	    !gpa_to_hpa(vcpu, gpa, &hpa)) {
@@ -1337,8 +1383,8 @@ static bool vcpu_handle_vmptrld(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu))
 		goto out;
 
-	uintptr_t disp = vmcs_read(EXIT_QUALIFICATION);
-	u32 inst = vmcs_read32(VMX_INSTRUCTION_INFO);
+	uintptr_t disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u32 inst = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_read_vmx_addr(vcpu, gva, &gpa) ||
 	    !gpa_to_hpa(vcpu, gpa, &hpa)) {
@@ -1383,8 +1429,8 @@ static bool vcpu_handle_vmptrst(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu))
 		goto out;
 
-	u64 disp = vmcs_read(EXIT_QUALIFICATION);
-	u64 inst = vmcs_read(VMX_INSTRUCTION_INFO);
+	u64 disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u64 inst = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_write_vmx_addr(vcpu, gva, nested->vmcs_region))
 		goto out;
@@ -1404,7 +1450,7 @@ static bool vcpu_handle_vmread(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu) || vmcs == 0)
 		goto err;
 
-	u32 inst = vmcs_read32(VMX_INSTRUCTION_INFO);
+	u32 inst = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	u32 field = ksm_read_reg(vcpu, (inst >> 28) & 15);
 	u64 value;
 	if (!nested_vmcs_read(vmcs, field, &value)) {
@@ -1414,7 +1460,7 @@ static bool vcpu_handle_vmread(struct vcpu *vcpu)
 
 	if ((inst >> 10) & 1)
 		ksm_write_reg(vcpu, (inst >> 3) & 15, value);
-	else if (!vcpu_parse_vmx_addr(vcpu, vmcs_read(EXIT_QUALIFICATION), inst, &gva))
+	else if (!vcpu_parse_vmx_addr(vcpu, vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION), inst, &gva))
 		goto err;
 	else
 		vcpu_write_vmx_addr(vcpu, gva, value);
@@ -1462,7 +1508,7 @@ static bool vcpu_handle_vmwrite(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu) || vmcs == 0)
 		goto out;
 
-	u64 inst = vmcs_read(VMX_INSTRUCTION_INFO);
+	u64 inst = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
 	u32 field = ksm_read_reg(vcpu, (inst >> 28) & 15);
 	if (field_ro(field)) {
 		vcpu_vm_fail_valid(vcpu, VMXERR_VMWRITE_READ_ONLY_VMCS_COMPONENT);
@@ -1475,7 +1521,7 @@ static bool vcpu_handle_vmwrite(struct vcpu *vcpu)
 		value = ksm_read_reg(vcpu, (inst >> 3) & 15);
 	} else {
 		/* memory address  */
-		u64 disp = vmcs_read(EXIT_QUALIFICATION);
+		u64 disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 		if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 		    !vcpu_read_vmx_addr(vcpu, gva, &value))
 			goto out;
@@ -1557,21 +1603,21 @@ static bool vcpu_handle_vmon(struct vcpu *vcpu)
 		goto out;
 	}
 
-	uintptr_t disp = vmcs_read(EXIT_QUALIFICATION);
-	u32 inst = vmcs_read32(VMX_INSTRUCTION_INFO);
+	uintptr_t disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u32 inst = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_read_vmx_addr(vcpu, gva, &gpa) ||
 	    !gpa_to_hpa(vcpu, gpa, &hpa))
 		goto out;
 
-	char *tmp = mm_remap(hpa, PAGE_SIZE);
+	char *tmp = vcpu_map_page(vcpu, hpa);
 	if (!tmp) {
 		vcpu_vm_fail_invalid(vcpu);
 		goto out;
 	}
 
 	bool match = *(u32 *)tmp == (u32)__readmsr(MSR_IA32_VMX_BASIC);
-	mm_unmap(tmp, PAGE_SIZE);
+	vcpu_unmap_page(vcpu, tmp);
 	if (!match) {
 		vcpu_vm_fail_invalid(vcpu);
 		goto out;
@@ -1596,13 +1642,13 @@ static bool vcpu_handle_invept(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu))
 		goto out;
 
-	u64 disp = vmcs_read(EXIT_QUALIFICATION);
-	u64 inst = vmcs_read(VMX_INSTRUCTION_INFO);
+	u64 disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u64 inst = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_read_vmx_addr(vcpu, gva, (u64 *)&ept))
 		goto out;
 
-	u32 info = vmcs_read32(VMX_INSTRUCTION_INFO);
+	u32 info = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	u32 type = ksm_read_reg32(vcpu, (info >> 28) & 15);
 	u32 avail = (__readmsr(MSR_IA32_VMX_EPT_VPID_CAP) >> VMX_EPT_EXTENT_SHIFT) & 6;
 	if (!(avail & (1 << type))) {
@@ -1635,13 +1681,13 @@ static bool vcpu_handle_invvpid(struct vcpu *vcpu)
 	if (!nested_can_exec_vmx(vcpu))
 		goto out;
 
-	u64 disp = vmcs_read(EXIT_QUALIFICATION);
-	u64 inst = vmcs_read(VMX_INSTRUCTION_INFO);
+	u64 disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	u64 inst = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
 	if (!vcpu_parse_vmx_addr(vcpu, disp, inst, &gva) ||
 	    !vcpu_read_vmx_addr(vcpu, gva, (u64 *)&vpid))
 		goto out;
 
-	u32 info = vmcs_read32(VMX_INSTRUCTION_INFO);
+	u32 info = vcpu_vmcs_read32(vcpu, VMX_INSTRUCTION_INFO);
 	u32 type = ksm_read_reg32(vcpu, (info >> 28) & 15);
 	u32 avail = (__readmsr(MSR_IA32_VMX_EPT_VPID_CAP) >> VMX_VPID_EXTENT_SHIFT) & 7;
 	if (!(avail & (1 << type))) {
@@ -1666,19 +1712,15 @@ out:
 #else
 static bool vcpu_handle_vmx(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
 	vcpu_inject_hardirq_noerr(vcpu, X86_TRAP_UD);
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 #endif
 
 static bool vcpu_handle_cr_access(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
-	uintptr_t exit = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	uintptr_t *val;
 	int cr = exit & 15;
 	int reg = (exit >> 8) & 15;
@@ -1701,10 +1743,14 @@ static bool vcpu_handle_cr_access(struct vcpu *vcpu)
 			ksm_sandbox_handle_cr3(vcpu, *val);
 #endif
 			__invvpid_no_global(vpid_nr());
+			if (!(vmcs_read(GUEST_CR4) & X86_CR4_PCIDE) ||
+			    !(*val & X86_CR3_PCID_NOFLUSH))
+				vcpu_flush_gtlb(vcpu);
 			vmcs_write(GUEST_CR3, *val);
 			break;
 		case 4:
 			__invvpid_single(vpid_nr());
+			vcpu_flush_gtlb(vcpu);
 			if (*val & vcpu->cr4_guest_host_mask) {
 #ifdef NESTED_VMX
 				if (!(*val & (vcpu->cr4_guest_host_mask & ~X86_CR4_VMXE))) {
@@ -1764,15 +1810,12 @@ static bool vcpu_handle_cr_access(struct vcpu *vcpu)
 	}
 
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_dr_access(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
-	uintptr_t exit = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	int dr = exit & DEBUG_REG_ACCESS_NUM;
 
 	if (vcpu_inject_gp_if(vcpu, !vcpu_probe_cpl(0)))
@@ -1828,13 +1871,12 @@ static bool vcpu_handle_dr_access(struct vcpu *vcpu)
 
 out:
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_io_port(struct vcpu *vcpu)
 {
-	uintptr_t exit = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	uintptr_t *addr = ksm_reg(vcpu, REG_AX);
 	if (exit & 16) {
 		/* string  */
@@ -1890,7 +1932,7 @@ static bool vcpu_handle_io_port(struct vcpu *vcpu)
 		* For in the register is RDI, for out it's RSI.
 		*/
 		uintptr_t *reg = ksm_reg(vcpu, (exit & 8) ? REG_DI : REG_SI);
-		if (vcpu->eflags & X86_EFLAGS_DF)
+		if (vcpu_rflags(vcpu) & X86_EFLAGS_DF)
 			*reg -= count * size;
 		else
 			*reg += count * size;
@@ -1908,8 +1950,6 @@ static bool vcpu_handle_io_port(struct vcpu *vcpu)
 
 static bool vcpu_handle_rdmsr(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	u32 msr = ksm_read_reg32(vcpu, REG_CX);
 	u64 val = 0;
 
@@ -1958,14 +1998,11 @@ static bool vcpu_handle_rdmsr(struct vcpu *vcpu)
 	ksm_write_reg32(vcpu, REG_AX, val);
 	ksm_write_reg32(vcpu, REG_DX, val >> 32);
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_wrmsr(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	u32 msr = ksm_read_reg32(vcpu, REG_CX);
 	u64 val = ksm_combine_reg64(vcpu, REG_AX, REG_DX);
 
@@ -2021,24 +2058,19 @@ static bool vcpu_handle_wrmsr(struct vcpu *vcpu)
 	}
 
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_invalid_state(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-	KSM_PANIC(KSM_PANIC_GUEST_STATE, vcpu->ip, vcpu->eflags, prev_handler);
-	VCPU_TRACER_END();
+	KSM_PANIC(KSM_PANIC_GUEST_STATE, vcpu_rip(vcpu), vcpu_rflags(vcpu), prev_handler);
 	return false;
 }
 
 static bool vcpu_handle_mtf(struct vcpu *vcpu)
 {
 	/* Monitor Trap Flag, it's not recommended to use this at all.  */
-	VCPU_TRACER_START();
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
@@ -2053,7 +2085,7 @@ static bool vcpu_handle_tpr_threshold(struct vcpu *vcpu)
 
 static bool vcpu_handle_apic_access(struct vcpu *vcpu)
 {
-	u32 exit = vmcs_read32(EXIT_QUALIFICATION);
+	u32 exit = vcpu_vmcs_read32(vcpu, EXIT_QUALIFICATION);
 	u16 offset = exit & APIC_ACCESS_OFFSET;
 	u32 type = exit & APIC_ACCESS_TYPE;
 
@@ -2064,7 +2096,7 @@ static bool vcpu_handle_apic_access(struct vcpu *vcpu)
 
 static bool vcpu_handle_eoi_induced(struct vcpu *vcpu)
 {
-	u32 exit = vmcs_read32(EXIT_QUALIFICATION);
+	u32 exit = vcpu_vmcs_read32(vcpu, EXIT_QUALIFICATION);
 	u16 vector = exit & 0xFFF;
 
 	KSM_DEBUG("!!! EOI induced, vector: 0x%04X\n", vector);
@@ -2081,12 +2113,12 @@ static inline void vcpu_sync_idt(struct vcpu *vcpu, struct gdtr *idt)
 	struct kidt_entry64 *current_idt;
 	struct kidt_entry64 *shadow = (struct kidt_entry64 *)vcpu->idt.base;
 
-	current_idt = mm_alloc_page();
+	current_idt = vcpu_alloc_page(vcpu);
 	if (!current_idt)
 		return;
 
 	if (!ksm_read_virt(vcpu, idt->base, (u8 *)current_idt, idt->limit)) {
-		mm_free_pool(current_idt, PAGE_SIZE);
+		vcpu_free_page(vcpu, current_idt);
 		return vcpu_inject_pf(vcpu, idt->base, PGF_PRESENT);
 	}
 
@@ -2099,13 +2131,13 @@ static inline void vcpu_sync_idt(struct vcpu *vcpu, struct gdtr *idt)
 		if (!idte_present(&vcpu->shadow_idt[n]))
 			memcpy(&shadow[n], &current_idt[n], sizeof(*shadow));
 	vcpu_flush_idt(vcpu);
-	mm_free_page(current_idt);
+	vcpu_free_page(vcpu, current_idt);
 }
 
 static bool vcpu_handle_gdt_idt_access(struct vcpu *vcpu)
 {
-	uintptr_t info = vmcs_read(VMX_INSTRUCTION_INFO);
-	uintptr_t disp = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t info = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
+	uintptr_t disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	uintptr_t addr = disp;
 	struct gdtr dt;
 
@@ -2154,8 +2186,8 @@ static bool vcpu_handle_gdt_idt_access(struct vcpu *vcpu)
 
 static bool vcpu_handle_ldt_tr_access(struct vcpu *vcpu)
 {
-	uintptr_t info = vmcs_read(VMX_INSTRUCTION_INFO);
-	uintptr_t disp = vmcs_read(EXIT_QUALIFICATION);
+	uintptr_t info = vcpu_vmcs_read(vcpu, VMX_INSTRUCTION_INFO);
+	uintptr_t disp = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	uintptr_t addr = disp;
 	u16 sel;
 	int sel_idx = (info >> 28) & 3;
@@ -2219,8 +2251,6 @@ static bool vcpu_handle_ldt_tr_access(struct vcpu *vcpu)
 
 static bool vcpu_handle_ept_violation(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	if (!ept_handle_violation(vcpu)) {
 #ifdef NESTED_VMX
 		struct nested_vcpu *nested = &vcpu->nested_vcpu;
@@ -2235,20 +2265,17 @@ static bool vcpu_handle_ept_violation(struct vcpu *vcpu)
 
 		KSM_PANIC(EPT_BUGCHECK_CODE,
 			      EPT_UNHANDLED_VIOLATION,
-			      vcpu->ip,
-			      vmcs_read64(GUEST_PHYSICAL_ADDRESS));
+			      vcpu_rip(vcpu),
+			      vcpu_vmcs_read64(vcpu, GUEST_PHYSICAL_ADDRESS));
 	}
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_ept_misconfig(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
-	struct ept *ept = &vcpu->ept;
-	u64 gpa = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
+	struct ept *ept = vcpu_ept(vcpu);
+	u64 gpa = vcpu_vmcs_read64(vcpu, GUEST_PHYSICAL_ADDRESS);
 	u16 eptp = vcpu_eptp_idx(vcpu);
 
 	u64 *epte = ept_pte(EPT4(ept, eptp), gpa);
@@ -2258,8 +2285,6 @@ static bool vcpu_handle_ept_misconfig(struct vcpu *vcpu)
 
 static bool vcpu_handle_rdtscp(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	u32 tsc_aux;
 	u64 tsc = __rdtscp((unsigned int *)&tsc_aux);
 
@@ -2268,35 +2293,29 @@ static bool vcpu_handle_rdtscp(struct vcpu *vcpu)
 	ksm_write_reg32(vcpu, REG_CX, tsc_aux);
 	vcpu_advance_rip(vcpu);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_wbinvd(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
 	__wbinvd();
 	vcpu_advance_rip(vcpu);
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_xsetbv(struct vcpu *vcpu)
 {
-	VCPU_TRACER_START();
-
 	u32 ext = ksm_read_reg32(vcpu, REG_CX);
 	u64 val = ksm_combine_reg64(vcpu, REG_AX, REG_DX);
 	_xsetbv(ext, val);
 	vcpu_advance_rip(vcpu);
 
-	VCPU_TRACER_END();
 	return true;
 }
 
 static bool vcpu_handle_apic_write(struct vcpu *vcpu)
 {
-	u32 exit = vmcs_read32(EXIT_QUALIFICATION);
+	u32 exit = vcpu_vmcs_read32(vcpu, EXIT_QUALIFICATION);
 	u16 offset = exit & 0xFF0;
 
 	KSM_DEBUG("!!! APIC write at offset 0x%04X\n", offset);
@@ -2315,7 +2334,7 @@ static inline bool nested_can_handle_cr(const struct nested_vcpu *nested)
 	 * if they have cr3-exiting.
 	 */
 	struct vcpu *vcpu = container_of(nested, struct vcpu, nested_vcpu);
-	u32 exit = vmcs_read32(EXIT_QUALIFICATION);
+	u32 exit = vcpu_vmcs_read32(vcpu, EXIT_QUALIFICATION);
 	uintptr_t vmcs = nested->vmcs;
 
 	switch ((exit >> 4) & 3) {
@@ -2380,7 +2399,7 @@ static inline bool nested_can_handle_io(const struct nested_vcpu *nested)
 {
 	struct vcpu *vcpu = container_of(nested, struct vcpu, nested_vcpu);
 	uintptr_t vmcs = nested->vmcs;
-	u32 exit = vmcs_read32(EXIT_QUALIFICATION);
+	u32 exit = vcpu_vmcs_read32(vcpu, EXIT_QUALIFICATION);
 	u16 port = exit;
 	u16 size = (exit & 7) + 1;
 	u64 bitmap = ~0ULL;
@@ -2401,12 +2420,12 @@ static inline bool nested_can_handle_io(const struct nested_vcpu *nested)
 			if (!gpa_to_hpa(vcpu, bitmap, &hpa))
 				return false;
 
-			char *v = mm_remap(hpa, PAGE_SIZE);
+			char *v = vcpu_map_page(vcpu, hpa);
 			if (!v)
 				return false;
 
 			byte = *(u8 *)(v + addr_offset(bitmap));
-			mm_unmap(v, PAGE_SIZE);
+			vcpu_unmap_page(vcpu, v);
 		}
 
 		if ((byte >> (port & 7)) & 1)
@@ -2432,7 +2451,7 @@ static inline bool nested_can_handle_msr(const struct nested_vcpu *nested, bool
 	if (!gpa_to_hpa(vcpu, gpa, &hpa))
 		return ret;
 
-	bitmap = mm_remap(hpa, PAGE_SIZE);
+	bitmap = vcpu_map_page(vcpu, hpa);
 	if (!bitmap)
 		return ret;
 
@@ -2445,7 +2464,7 @@ static inline bool nested_can_handle_msr(const struct nested_vcpu *nested, bool
 	}
 
 	ret = ((*(u8 *)(bitmap + msr / 8)) >> (msr % 8)) & 1;
-	mm_unmap(bitmap, PAGE_SIZE);
+	vcpu_unmap_page(vcpu, bitmap);
 	return ret;
 }
 
@@ -2648,6 +2667,29 @@ static bool(*g_handlers[]) (struct vcpu *) = {
 	[EXIT_REASON_PCOMMIT] = vcpu_nop
 };
 
+#ifdef ENABLE_STATS
+/*
+ * Account @cycles to @h, in bucket log2(@cycles).  Runs on every exit, so
+ * keep it cheap: no locks, only this CPU ever writes its own stats.
+ */
+static inline void stats_record(struct ksm_exit_hist *h, u64 cycles)
+{
+	unsigned long n = 0;
+
+#ifdef _MSC_VER
+	_BitScanReverse64(&n, cycles | 1);
+#else
+	n = 63 - __builtin_clzll(cycles | 1);
+#endif
+	if (n >= KSM_STATS_BUCKETS)
+		n = KSM_STATS_BUCKETS - 1;
+
+	h->count++;
+	h->cycles += cycles;
+	h->hist[n]++;
+}
+#endif
+
 static inline void vcpu_dump_state(const struct vcpu *vcpu, const struct regs *regs)
 {
 	KSM_DEBUG("%p: ax=0x%016llX   cx=0x%016llX  dx=0x%016llX\n"
@@ -2681,17 +2723,23 @@ bool vcpu_handle_exit(uintptr_t *stack)
 	struct vcpu *vcpu = (struct vcpu *)stack[REG_MAX];
 	struct pending_irq *irq = &vcpu->irq;
 	bool ret = true;
+#ifdef ENABLE_STATS
+	u64 tsc = __rdtsc();
+#endif
 
 	vcpu->gp = stack;
 	vcpu->gp[REG_SP] = vmcs_read(GUEST_RSP);
-	vcpu->eflags = vmcs_read(GUEST_RFLAGS);
-	vcpu->ip = vmcs_read(GUEST_RIP);
+	vcpu_vmcs_reset(vcpu);
+	vcpu_sync_gtlb(vcpu);
 
 	u32 exit_reason = vmcs_read32(VM_EXIT_REASON);
 #ifdef DBG
 	prev_handler = curr_handler;
 #endif
 	curr_handler = (u16)exit_reason;
+#ifdef ENABLE_TRACE
+	vcpu_trace(vcpu, exit_reason);
+#endif
 
 #ifdef NESTED_VMX
 	/*
@@ -2707,11 +2755,13 @@ bool vcpu_handle_exit(uintptr_t *stack)
 	}
 #endif
 
-	uintptr_t eflags = vcpu->eflags;
-	if (curr_handler < sizeof(g_handlers) / sizeof(g_handlers[0]) &&
-	    (ret = g_handlers[curr_handler](vcpu)) &&
-	    (vcpu->eflags ^ eflags) != 0)
-		vmcs_write(GUEST_RFLAGS, vcpu->eflags);
+	if (curr_handler < sizeof(g_handlers) / sizeof(g_handlers[0]))
+		ret = g_handlers[curr_handler](vcpu);
+
+#ifdef ENABLE_STATS
+	if (curr_handler < KSM_STATS_REASONS)
+		stats_record(&vcpu->stats->handler[curr_handler], __rdtsc() - tsc);
+#endif
 
 	if (exit_reason & VMX_EXIT_REASONS_FAILED_VMENTRY &&
 	    curr_handler != EXIT_REASON_INVALID_STATE) {
@@ -2720,8 +2770,8 @@ bool vcpu_handle_exit(uintptr_t *stack)
 		 * error that happened past VM-exit.
 		 */
 		dbgbreak();
-		KSM_PANIC(KSM_PANIC_FAILED_VMENTRY, vcpu->ip,
-			      vmcs_read(EXIT_QUALIFICATION), curr_handler);
+		KSM_PANIC(KSM_PANIC_FAILED_VMENTRY, vcpu_rip(vcpu),
+			      vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION), curr_handler);
 	}
 
 	if (!ret) {
@@ -2735,8 +2785,17 @@ bool vcpu_handle_exit(uintptr_t *stack)
 #ifdef NESTED_VMX
 do_pending_irq:
 #endif
+		/* Write back RIP, RFLAGS, etc. if the handler changed them.  */
+		vcpu_vmcs_flush(vcpu);
+
+		/* Catch up with EPT updates made by other CPUs, if any.  */
+		vcpu_sync_ept(vcpu);
+
 		if (irq->pending) {
 			bool injected = false;
+#ifdef ENABLE_STATS
+			tsc = __rdtsc();
+#endif
 
 			if (irq->bits & INTR_INFO_DELIVER_CODE_MASK)
 				injected = vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, irq->err) == 0;
@@ -2746,6 +2805,9 @@ do_pending_irq:
 				injected &= vmcs_write32(VM_ENTRY_INSTRUCTION_LEN, irq->instr_len) == 0;
 
 			irq->pending = !injected;
+#ifdef ENABLE_STATS
+			stats_record(&vcpu->stats->irq, __rdtsc() - tsc);
+#endif
 		}
 	}
 
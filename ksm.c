@@ -116,6 +116,61 @@ static inline void free_io_bitmaps(struct ksm *k)
 		mm_free_page(k->io_bitmap_b);
 }
 
+#ifdef ENABLE_STATS
+/*
+ * Exit statistics live as long as ksm does (not just while the CPU is
+ * virtualized), so they can be read at any time without racing with
+ * vcpu_free().
+ */
+static inline void free_exit_stats(struct ksm *k)
+{
+	struct vcpu *vcpu;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		vcpu = ksm_cpu_at(k, i);
+		if (vcpu->stats) {
+			mm_free_pool(vcpu->stats, sizeof(*vcpu->stats));
+			vcpu->stats = NULL;
+		}
+	}
+}
+
+static inline int init_exit_stats(struct ksm *k)
+{
+	struct vcpu *vcpu;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		vcpu = ksm_cpu_at(k, i);
+		vcpu->stats = mm_alloc_pool(sizeof(*vcpu->stats));
+		if (!vcpu->stats) {
+			free_exit_stats(k);
+			return ERR_NOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the exit statistics of @cpu to @out, this does not stop the CPU from
+ * updating them, so the copy may be slightly inconsistent (e.g. count vs sum
+ * of buckets) but never torn for a single counter.
+ */
+int ksm_read_stats(struct ksm *k, int cpu, struct ksm_exit_stats *out)
+{
+	if (cpu < 0 || cpu >= KSM_MAX_VCPUS)
+		return ERR_RANGE;
+
+	memcpy(out, ksm_cpu_at(k, cpu)->stats, sizeof(*out));
+	return 0;
+}
+#else
+static inline int init_exit_stats(struct ksm *k) { return 0; }
+static inline void free_exit_stats(struct ksm *k) { }
+#endif
+
 /*
  * Virtualizes current CPU, shared stuff, i.e. MSR bitmap
  * and IO bitmaps must be initialized prior to this call.
@@ -175,6 +230,12 @@ int __ksm_init_cpu(struct ksm *k)
 static DEFINE_DPC(__call_init, __ksm_init_cpu, ctx);
 int ksm_subvert(struct ksm *k)
 {
+#ifdef SHARED_EPT
+	int ret = ksm_init_ept(k);
+	if (ret < 0)
+		return ret;
+#endif
+
 	CALL_DPC(__call_init, k);
 	return DPC_RET();
 }
@@ -213,6 +274,7 @@ int ksm_init(struct ksm **kp)
 	if (!k)
 		return ret;
 
+	k->ept_cap = vpid;
 #ifdef EPAGE_HOOK
 	htable_init(&k->ht, rehash, NULL);
 #endif
@@ -236,10 +298,26 @@ int ksm_init(struct ksm **kp)
 	if (ret < 0)
 		goto out_msr;
 
-	ret = register_power_callback();
+	ret = ksm_reserve_init(k);
 	if (ret < 0)
 		goto out_io;
 
+	ret = ksm_map_init(k);
+	if (ret < 0)
+		goto out_reserve;
+
+	ret = init_exit_stats(k);
+	if (ret < 0)
+		goto out_map;
+
+	ret = ksm_trace_init(k);
+	if (ret < 0)
+		goto out_stats;
+
+	ret = register_power_callback();
+	if (ret < 0)
+		goto out_trace;
+
 	ret = register_cpu_callback();
 	if (ret == 0) {
 		*kp = k;
@@ -247,6 +325,14 @@ int ksm_init(struct ksm **kp)
 	}
 
 	unregister_power_callback();
+out_trace:
+	ksm_trace_exit(k);
+out_stats:
+	free_exit_stats(k);
+out_map:
+	ksm_map_exit(k);
+out_reserve:
+	ksm_reserve_exit(k);
 out_io:
 	free_io_bitmaps(k);
 out_msr:
@@ -292,6 +378,10 @@ int ksm_unsubvert(struct ksm *k)
 	if (k->active_vcpus == 0)
 		return ERR_NOTH;
 
+#ifdef PMEM_SANDBOX
+	/* The views go with the vCPUs.  */
+	ksm_sandbox_unbox_all(k);
+#endif
 	CALL_DPC(__call_exit, k);
 	return DPC_RET();
 }
@@ -304,15 +394,24 @@ int ksm_free(struct ksm *k)
 {
 	int ret;
 
+#ifdef PMEM_SANDBOX
+	/* Its thread and probes issue hypercalls.  */
+	ksm_sandbox_exit(k);
+#endif
 	ret = ksm_unsubvert(k);
+#ifdef SHARED_EPT
+	ksm_free_ept(k);
+#endif
+	ksm_reserve_exit(k);
+	ksm_map_exit(k);
+	free_exit_stats(k);
+	ksm_trace_exit(k);
 	free_msr_bitmap(k);
 	free_io_bitmaps(k);
 #ifdef EPAGE_HOOK
 	htable_clear(&k->ht);
 #endif
-#ifdef PMEM_SANDBOX
-	ksm_sandbox_exit(k);
-#endif
+	ksm_slab_exit();
 	unregister_cpu_callback();
 	unregister_power_callback();
 	return ret;
@@ -352,6 +451,52 @@ int ksm_free_idt(unsigned n)
 	return DPC_RET();
 }
 
+#ifdef SHARED_EPT
+static DEFINE_DPC(__call_invept, __vmx_vmcall, HYPERCALL_INVEPT, ctx);
+#else
+static DEFINE_DPC(__call_ar_range, __vmx_vmcall, HYPERCALL_AR_RANGE, ctx);
+#endif
+
+/*
+ * Change the access of all pages in @ops (see ept_set_ar_range()) on all
+ * CPUs with one hypercall each, and one invalidation per CPU, e.g. to
+ * write-protect a whole kernel section:
+ * \code
+ *	struct ept_ar_op op = {
+ *		.gpa = __pa(start),
+ *		.size = end - start,
+ *		.eptp = EPTP_DEFAULT,
+ *		.ar = EPT_ACCESS_READ | EPT_ACCESS_EXEC,
+ *	};
+ *	ksm_set_ar_range(&op, 1);
+ * \endcode
+ *
+ * Returns ERR_NOMEM if a table couldn't be allocated on some CPU, the ops
+ * before it are still applied there.
+ */
+int ksm_set_ar_range(const struct ept_ar_op *ops, int count)
+{
+	struct ept_ar_batch batch = {
+		.ops = ops,
+		.count = count,
+	};
+#ifdef SHARED_EPT
+	/*
+	 * The EPT is shared, update it once, then have all CPUs invalidate.
+	 * The hypercall only fails if a table couldn't be allocated.
+	 */
+	if (__vmx_vmcall(HYPERCALL_AR_RANGE, &batch))
+		return ERR_NOMEM;
+
+	CALL_DPC(__call_invept, NULL);
+#else
+	CALL_DPC(__call_ar_range, &batch);
+	if (DPC_RET())
+		return ERR_NOMEM;
+#endif
+	return 0;
+}
+
 /*
  * Write @data of length @len into @gva.
  * If it returns false, a fault should be injected.
@@ -376,7 +521,7 @@ bool ksm_write_virt(struct vcpu *vcpu, u64 gva, const u8 *data, size_t len)
 		if (!gpa_to_hpa(vcpu, gpa, &hpa))
 			return false;
 
-		tmp = mm_remap(hpa, PAGE_SIZE);
+		tmp = vcpu_map_page(vcpu, hpa);
 		if (!tmp)
 			return false;
 
@@ -384,7 +529,7 @@ bool ksm_write_virt(struct vcpu *vcpu, u64 gva, const u8 *data, size_t len)
 		off = addr_offset(gva);
 		copy = min(len, PAGE_SIZE - off);
 		memcpy(tmp + off, data, copy);
-		mm_unmap(tmp, PAGE_SIZE);
+		vcpu_unmap_page(vcpu, tmp);
 
 		len -= copy;
 		data += copy;
@@ -418,7 +563,7 @@ bool ksm_read_virt(struct vcpu *vcpu, u64 gva, u8 *data, size_t len)
 		if (!gpa_to_hpa(vcpu, gpa, &hpa))
 			return false;
 
-		tmp = mm_remap(hpa, PAGE_SIZE);
+		tmp = vcpu_map_page(vcpu, hpa);
 		if (!tmp)
 			return false;
 
@@ -426,7 +571,7 @@ bool ksm_read_virt(struct vcpu *vcpu, u64 gva, u8 *data, size_t len)
 		off = addr_offset(gva);
 		copy = min(len, PAGE_SIZE - off);
 		memcpy(d, tmp + off, copy);
-		mm_unmap(tmp, PAGE_SIZE);
+		vcpu_unmap_page(vcpu, tmp);
 
 		len -= copy;
 		d += copy;
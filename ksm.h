@@ -27,6 +27,17 @@
 #include "mm.h"
 #include "bitmap.h"
 #include "htable.h"
+#include "um/um.h"
+
+/* Sandbox views are used by all vCPUs, see Note #7 in sandbox.c  */
+#if defined(PMEM_SANDBOX) && !defined(SHARED_EPT)
+#error PMEM_SANDBOX needs SHARED_EPT, define both
+#endif
+
+/* The scheduler hook of SANDBOX_VMFUNC only exists on Linux, see sandbox.c  */
+#if defined(SANDBOX_VMFUNC) && (!defined(PMEM_SANDBOX) || !defined(__linux__))
+#undef SANDBOX_VMFUNC
+#endif
 
 #define KSM_MAX_VCPUS		32
 #define __EXCEPTION_BITMAP	0
@@ -42,6 +53,17 @@
 #ifdef PMEM_SANDBOX
 #define HYPERCALL_SA_TASK	6	/* Sandbox: free EPTPs */
 #endif
+#ifdef SHARED_EPT
+#define HYPERCALL_INVEPT	7	/* Invalidate EPT after an update on another CPU  */
+#endif
+#define HYPERCALL_AR_RANGE	8	/* Change access of many pages  */
+#ifdef PMEM_SANDBOX
+#define HYPERCALL_SA_NEW	9	/* Sandbox: create the view of a new task  */
+#define HYPERCALL_SA_FREE	10	/* Sandbox: free the view of a task  */
+#define HYPERCALL_SA_SNAP	11	/* Sandbox: mark a snapshot point  */
+#define HYPERCALL_SA_RESET	12	/* Sandbox: go back to the snapshot  */
+#define HYPERCALL_SA_DEDUP	13	/* Sandbox: merge identical COW pages  */
+#endif
 
 /*
  * NOTE:
@@ -123,18 +145,6 @@
 #else
 #define KSM_DEBUG(fmt, ...)
 #define KSM_DEBUG_RAW(str)
-#endif
-
-/*
- * Should definitely replace this with something more useful, right now this is
- * utterly useless...
- */
-#ifdef VCPU_TRACER_LOG
-#define VCPU_TRACER_START()		KSM_DEBUG("%p\n", gc)
-#define VCPU_TRACER_END()		KSM_DEBUG("%p handled\n", gc)
-#else
-#define VCPU_TRACER_START()
-#define VCPU_TRACER_END()
 #endif
 
  /* EPT Memory type  */
@@ -183,6 +193,15 @@
 	for (int i = 0; i < EPT_MAX_EPTP_LIST; ++i)	\
 		if (test_bit(i, ept->ptr_bitmap))
 
+/* EPT paging structure levels, a PDPT or PD entry can be a large leaf  */
+#define EPT_LEVEL_PML4			4
+#define EPT_LEVEL_PDPT			3			/* 1 GB leaf  */
+#define EPT_LEVEL_PD			2			/* 2 MB leaf  */
+#define EPT_LEVEL_PT			1			/* 4 KB leaf  */
+#define ept_level_shift(l)		(PTI_SHIFT + ((l) - 1) * 9)
+#define ept_level_size(l)		(1ULL << ept_level_shift(l))
+#define ept_entry(table, l, gpa)	(&(table)[((gpa) >> ept_level_shift(l)) & PTX_MASK])
+
 #define EPT_BUGCHECK_CODE		0x3EDFAAAA
 #define EPT_BUGCHECK_TOOMANY		0xFFFFFFFE
 #define EPT_BUGCHECK_MISCONFIG		0xE3E3E3E3
@@ -336,6 +355,41 @@ struct pending_irq {
 	u32 instr_len;
 };
 
+/*
+ * VMCS fields cached for the duration of one VM-exit: read on first use with
+ * vcpu_vmcs_read(), written back by vcpu_vmcs_flush() right before VM-entry,
+ * and only if vcpu_vmcs_write() actually changed them.  Adding a field here is
+ * all it takes for every handler reading it through vcpu_vmcs_read() to get
+ * it cached, but then it must no longer be written with vmcs_write() during
+ * an exit (other than after vcpu_vmcs_sync()).
+ *
+ * GUEST_RSP is not here, it's read on each exit anyway as it's part of the
+ * register file, see vcpu_handle_exit().
+ */
+#define VMCS_CACHED_FIELDS(X)			\
+	X(GUEST_RIP)				\
+	X(GUEST_RFLAGS)				\
+	X(GUEST_INTERRUPTIBILITY_INFO)		\
+	X(EXIT_QUALIFICATION)			\
+	X(VM_EXIT_INSTRUCTION_LEN)		\
+	X(VM_EXIT_INTR_INFO)			\
+	X(VMX_INSTRUCTION_INFO)			\
+	X(GUEST_LINEAR_ADDRESS)			\
+	X(GUEST_PHYSICAL_ADDRESS)
+
+enum {
+#define VMCS_CACHE_IDX(field)	VMCS_CACHE_##field,
+	VMCS_CACHED_FIELDS(VMCS_CACHE_IDX)
+#undef VMCS_CACHE_IDX
+	VMCS_CACHE_MAX
+};
+
+struct vmcs_cache {
+	u32 valid;
+	u32 dirty;
+	uintptr_t val[VMCS_CACHE_MAX];
+};
+
 #ifdef ENABLE_PML
 #define PML_MAX_ENTRIES		512
 #endif
@@ -350,11 +404,87 @@ struct ve_except_info {
 	u16 eptp;		/* current EPTP index  */
 };
 
+#define EPT_TABLE_HASH_BITS	9
+#define EPT_TABLE_HASH_SIZE	(1 << EPT_TABLE_HASH_BITS)
+struct ept_table;
+
 struct ept {
 	u64 *ptr_list;
 	u64 *pml4_list[EPT_MAX_EPTP_LIST];
 	unsigned long
 		ptr_bitmap[EPT_MAX_EPTP_LIST / sizeof(unsigned long)];
+	u64 *pristine[EPT_AR_MASK + 1];		/* identity maps views are copied from  */
+	struct ept_table *tables[EPT_TABLE_HASH_SIZE];	/* paging structures refcounts, see vcpu.c  */
+#ifdef SHARED_EPT
+	spinlock_t lock;			/* serializes updates, see ept_lock()  */
+#endif
+	u32 gen;				/* bumped on updates that need an INVEPT  */
+	u32 all_gen;				/* same, but for all views, see ept_flush_all()  */
+	u32 view_gen[EPT_MAX_EPTP_LIST];	/* same, per view, see ept_flush()  */
+};
+
+/* See ept_set_ar_range()  */
+struct ept_ar_op {
+	u64 gpa;		/* first page  */
+	u64 size;		/* in bytes  */
+	u16 eptp;		/* view  */
+	u8 ar;			/* new EPT_ACCESS_*  */
+};
+
+/* HYPERCALL_AR_RANGE argument  */
+struct ept_ar_batch {
+	const struct ept_ar_op *ops;
+	int count;
+};
+
+#define RESERVE_SIZE			64			/* must be a power of 2  */
+#define RESERVE_LOW			16			/* refill when below this  */
+#define RESERVE_HIGH			48			/* refill up to this  */
+#define RESERVE_REFILL_MS		10			/* refill thread period  */
+
+struct reserve_cell {
+	volatile u32 seq;
+	void *page;
+};
+
+#define MAP_SLOTS			4			/* nested vcpu_map_page() calls  */
+
+/* See mm.c  */
+struct map_window {
+	uintptr_t va;		/* MAP_SLOTS pages reserved for this vCPU  */
+	pte_t *pte[MAP_SLOTS];	/* and the PTEs that map them  */
+	int top;		/* slots are used like a stack  */
+};
+
+#define GTLB_SIZE			64			/* must be a power of 2  */
+
+struct gtlb_entry {
+	u64 cr3;		/* including the PCID  */
+	u64 vpn;		/* guest virtual page number  */
+	u64 gpa;		/* guest physical page  */
+	u32 flags;		/* PAGE_PRESENT, PAGE_WRITE, PAGE_USER of all levels  */
+	u32 gen;		/* valid if equal to gtlb->gen  */
+};
+
+/* See mm.c  */
+struct gtlb {
+	struct gtlb_entry e[GTLB_SIZE];
+	u32 gen;
+};
+
+/* See reserve.c  */
+struct page_reserve {
+	struct reserve_cell cells[RESERVE_SIZE];
+	volatile u32 enq;
+	volatile u32 deq;
+	spinlock_t lock;	/* refill thread vs vcpu init/free, never taken in root mode  */
+	bool active;
+	void *volatile deferred;	/* pages to free, chained through their first word  */
+	u64 taken;		/* pages handed out  */
+	u64 dry;		/* times it was empty  */
+	u64 refilled;		/* pages added by the refill thread  */
+	u64 returned;		/* pages given back by vcpu_free_page()  */
+	u64 overflow;		/* pages given back while it was full  */
 };
 
 struct vcpu {
@@ -376,14 +506,38 @@ struct vcpu {
 	bool subverted;
 	/* Those are set during VM-exit only:  */
 	uintptr_t *gp;
-	uintptr_t eflags;
-	uintptr_t ip;
+	struct vmcs_cache vmcs_cache;
 	uintptr_t cr0_guest_host_mask;
 	uintptr_t cr4_guest_host_mask;
 	/* Pending IRQ  */
 	struct pending_irq irq;
+	/* Zeroed pages for root mode  */
+	struct page_reserve reserve;
+	/* Physical mapping window for root mode  */
+	struct map_window map;
+	/* Guest virtual to guest physical translations  */
+	struct gtlb tlb;
+#ifndef SHARED_EPT
 	/* EPT for this CPU  */
 	struct ept ept;
+#endif
+	/* ept->*gen as of our last INVEPT, see vcpu_sync_ept()  */
+	volatile u32 *ept_gen_ptr;	/* &vcpu_ept(vcpu)->gen, for the fast path  */
+	u32 ept_gen;
+	u32 ept_all_gen;
+	u32 ept_view_gen[EPT_MAX_EPTP_LIST];
+	/* INVEPT statistics  */
+	u64 invept_single;
+	u64 invept_all;
+	u64 invept_avoided;
+#ifdef ENABLE_STATS
+	/* Per exit reason cycle histograms, see um/um.h  */
+	struct ksm_exit_stats *stats;
+#endif
+#ifdef ENABLE_TRACE
+	/* VM-exit trace ring, see trace.c  */
+	struct ksm_trace_hdr *trace;
+#endif
 	/* Guest IDT (emulated)  */
 	struct gdtr g_idt;
 	/* Shadow IDT (working)  */
@@ -394,6 +548,16 @@ struct vcpu {
 	/* EPTP before switch to per-task eptp.  */
 	u16 eptp_before;
 	void *last_switch;
+	/* Write stream of the task last run here, see Note #9 in sandbox.c  */
+	void *fa_task;
+	u64 fa_next;
+	u32 fa_window;
+	/* CR3-target values in use and supported, see ksm_sandbox_handle_cr3()  */
+	u8 nr_cr3_targets;
+	u8 max_cr3_targets;
+	u8 next_cr3_target;
+	/* CR3-load exiting can't be turned off on this processor  */
+	bool cr3_exit_fixed;
 #endif
 #ifdef NESTED_VMX
 	/* Nested  */
@@ -406,6 +570,117 @@ static inline bool vcpu_has_pending_irq(const struct vcpu *vcpu)
 	return vcpu->irq.pending;
 }
 
+/* Index of @field in the VMCS cache, or -1, folds to a constant.  */
+static inline int vmcs_cache_idx(u32 field)
+{
+	switch (field) {
+#define VMCS_CACHE_CASE(f)	case f: return VMCS_CACHE_##f;
+	VMCS_CACHED_FIELDS(VMCS_CACHE_CASE)
+#undef VMCS_CACHE_CASE
+	}
+
+	return -1;
+}
+
+static inline u32 vmcs_cache_field(int idx)
+{
+	switch (idx) {
+#define VMCS_CACHE_CASE(f)	case VMCS_CACHE_##f: return f;
+	VMCS_CACHED_FIELDS(VMCS_CACHE_CASE)
+#undef VMCS_CACHE_CASE
+	}
+
+	return 0;
+}
+
+static inline uintptr_t vcpu_vmcs_read(struct vcpu *vcpu, u32 field)
+{
+	struct vmcs_cache *c = &vcpu->vmcs_cache;
+	int i = vmcs_cache_idx(field);
+	if (i < 0)
+		return vmcs_read(field);
+
+	if (!(c->valid & (1u << i))) {
+		c->val[i] = vmcs_read(field);
+		c->valid |= 1u << i;
+	}
+
+	return c->val[i];
+}
+
+static inline u32 vcpu_vmcs_read32(struct vcpu *vcpu, u32 field)
+{
+	return (u32)vcpu_vmcs_read(vcpu, field);
+}
+
+static inline u64 vcpu_vmcs_read64(struct vcpu *vcpu, u32 field)
+{
+	return (u64)vcpu_vmcs_read(vcpu, field);
+}
+
+static inline void vcpu_vmcs_write(struct vcpu *vcpu, u32 field, uintptr_t val)
+{
+	struct vmcs_cache *c = &vcpu->vmcs_cache;
+	int i = vmcs_cache_idx(field);
+	if (i < 0) {
+		vmcs_write(field, val);
+		return;
+	}
+
+	if ((c->valid & (1u << i)) && c->val[i] == val)
+		return;
+
+	c->val[i] = val;
+	c->valid |= 1u << i;
+	c->dirty |= 1u << i;
+}
+
+/* Write back whatever changed, called before VM-entry.  */
+static inline void vcpu_vmcs_flush(struct vcpu *vcpu)
+{
+	struct vmcs_cache *c = &vcpu->vmcs_cache;
+	u32 dirty = c->dirty;
+	int i;
+
+	for (i = 0; dirty; ++i, dirty >>= 1)
+		if (dirty & 1)
+			vmcs_write(vmcs_cache_field(i), c->val[i]);
+
+	c->dirty = 0;
+}
+
+/* Called on VM-exit, nothing cached belongs to this exit yet.  */
+static inline void vcpu_vmcs_reset(struct vcpu *vcpu)
+{
+	vcpu->vmcs_cache.valid = 0;
+	vcpu->vmcs_cache.dirty = 0;
+}
+
+/*
+ * Write back and forget everything, for code that is about to access the
+ * VMCS directly (e.g. loading a whole new guest state).
+ */
+static inline void vcpu_vmcs_sync(struct vcpu *vcpu)
+{
+	vcpu_vmcs_flush(vcpu);
+	vcpu->vmcs_cache.valid = 0;
+}
+
+static inline uintptr_t vcpu_rip(struct vcpu *vcpu)
+{
+	return vcpu_vmcs_read(vcpu, GUEST_RIP);
+}
+
+static inline uintptr_t vcpu_rflags(struct vcpu *vcpu)
+{
+	return vcpu_vmcs_read(vcpu, GUEST_RFLAGS);
+}
+
+static inline void vcpu_set_rflags(struct vcpu *vcpu, uintptr_t rflags)
+{
+	vcpu_vmcs_write(vcpu, GUEST_RFLAGS, rflags);
+}
+
 static inline void ksm_write_reg16(struct vcpu *vcpu, int reg, u16 val)
 {
 	*(u16 *)&vcpu->gp[reg] = val;
@@ -478,24 +753,67 @@ static inline size_t rehash(const void *e, void *unused)
 }
 #endif
 
+#ifdef PMEM_SANDBOX
+#define SA_HASH_BITS		6
+#define SA_HASH_SIZE		(1 << SA_HASH_BITS)
+#define SA_DEDUP_BITS		10
+#define SA_DEDUP_SIZE		(1 << SA_DEDUP_BITS)
+struct sa_task;
+struct sa_member;
+struct cow_frame;
+#endif
+
 struct ksm {
 	int active_vcpus;
 	struct vcpu vcpu_list[KSM_MAX_VCPUS];
 	struct pmem_range ranges[MAX_RANGES];
 	int range_count;
+	void *map_area;		/* backs all vCPU map windows, see mm.c  */
 	uintptr_t host_pgd;
+	u64 ept_cap;
+#ifdef SHARED_EPT
+	struct ept ept;		/* shared by all vCPUs  */
+#endif
 #ifdef EPAGE_HOOK
 	struct htable ht;
 #endif
 #ifdef PMEM_SANDBOX
+	/* Boxed tasks, see Note #5 in sandbox.c  */
 	struct list_head task_list;
-	spinlock_t task_lock;
+	struct sa_member *volatile task_pgd[SA_HASH_SIZE];
+	struct sa_member *volatile task_pid[SA_HASH_SIZE];
+	spinlock_t task_lock;		/* writers only  */
+	/* Unlinked by exit probes, see Note #13 in sandbox.c  */
+	struct list_head sa_dead;
+	struct list_head sa_dead_members;
+	/* COW pages, see Note #10 in sandbox.c  */
+	volatile u32 sa_pages;
+	u32 sa_peak_pages;
+	u32 sa_max_pages;		/* 0: no limit  */
+	/* Merged COW frames, see Note #11 in sandbox.c  */
+	struct cow_frame *sa_frames[SA_DEDUP_SIZE];
+	struct cow_frame *volatile sa_orphans;
+	spinlock_t frame_lock;		/* root mode only  */
+	u32 sa_nr_frames;
+	volatile u32 sa_merged;
+	volatile u32 sa_split;
 #endif
 	void *msr_bitmap;
 	void *io_bitmap_a;
 	void *io_bitmap_b;
 };
 
+static inline bool ksm_is_ram(const struct ksm *k, u64 pa)
+{
+	int i;
+
+	for (i = 0; i < k->range_count; ++i)
+		if (pa >= k->ranges[i].start && pa < k->ranges[i].end)
+			return true;
+
+	return false;
+}
+
 /*
  * Do NOT use inside VMX root mode, use vcpu_to_ksm() instead...
  * Use this and I'll come after you.
@@ -518,6 +836,9 @@ extern int __ksm_init_cpu(struct ksm *k);
 extern int __ksm_exit_cpu(struct ksm *k);
 extern int ksm_hook_idt(unsigned n, void *h);
 extern int ksm_free_idt(unsigned n);
+#ifdef ENABLE_STATS
+extern int ksm_read_stats(struct ksm *k, int cpu, struct ksm_exit_stats *out);
+#endif
 extern bool ksm_write_virt(struct vcpu *vcpu, u64 gva, const u8 *data, size_t len);
 extern bool ksm_read_virt(struct vcpu *vcpu, u64 gva, u8 *data, size_t len);
 
@@ -550,6 +871,114 @@ static inline struct ksm *vcpu_to_ksm(struct vcpu *vcpu)
 #endif
 }
 
+static inline struct ept *vcpu_ept(struct vcpu *vcpu)
+{
+#ifdef SHARED_EPT
+	return &vcpu_to_ksm(vcpu)->ept;
+#else
+	return &vcpu->ept;
+#endif
+}
+
+/*
+ * With SHARED_EPT, all vCPUs walk the same paging structures, so updates
+ * must be done with ept_lock() held (a no-op otherwise).
+ *
+ * Any update that takes away access or changes a translation that may be
+ * cached must call ept_flush() for the view it changed (or ept_flush_all()),
+ * this only bumps generation counters: vcpu_sync_ept() then issues a
+ * single-context INVEPT for just the views that changed since that vCPU last
+ * looked, and nothing at all if none did.  It's called on every VM-exit,
+ * and right after an update by vcpu_invept() (or HYPERCALL_INVEPT when the
+ * update is broadcast with SHARED_EPT).
+ */
+static inline void ept_lock(struct ept *ept)
+{
+#ifdef SHARED_EPT
+	spin_lock(&ept->lock);
+#endif
+}
+
+static inline void ept_unlock(struct ept *ept)
+{
+#ifdef SHARED_EPT
+	spin_unlock(&ept->lock);
+#endif
+}
+
+static inline void ept_flush(struct ept *ept, u16 eptp)
+{
+	++ept->view_gen[eptp];
+	barrier();
+	++ept->gen;
+}
+
+static inline void ept_flush_all(struct ept *ept)
+{
+	++ept->all_gen;
+	barrier();
+	++ept->gen;
+}
+
+/* Root mode only  */
+static inline void vcpu_invept_all(struct vcpu *vcpu)
+{
+	struct ept *ept = vcpu_ept(vcpu);
+
+	vcpu->ept_gen = *(volatile u32 *)&ept->gen;
+	barrier();
+	vcpu->ept_all_gen = ept->all_gen;
+	memcpy(vcpu->ept_view_gen, ept->view_gen, sizeof(vcpu->ept_view_gen));
+	__invept_all();
+	++vcpu->invept_all;
+}
+
+/* Root mode only, invalidate @eptp regardless of its generation.  */
+static inline void vcpu_invept_view(struct vcpu *vcpu, u16 eptp)
+{
+	if (!(vcpu_to_ksm(vcpu)->ept_cap & VMX_EPT_EXTENT_CONTEXT_BIT))
+		return vcpu_invept_all(vcpu);
+
+	__invept_single(EPTP(vcpu_ept(vcpu), eptp));
+	++vcpu->invept_single;
+}
+
+/*
+ * Root mode only, invalidate the views that changed since last time, returns
+ * false if none did.
+ */
+static inline bool vcpu_sync_ept(struct vcpu *vcpu)
+{
+	struct ept *ept = vcpu_ept(vcpu);
+	u32 gen = *(volatile u32 *)&ept->gen;
+
+	if (vcpu->ept_gen == gen)
+		return false;
+
+	barrier();
+	if (vcpu->ept_all_gen != ept->all_gen) {
+		vcpu_invept_all(vcpu);
+		return true;
+	}
+
+	vcpu->ept_gen = gen;
+	for_each_eptp(ept, i) {
+		if (vcpu->ept_view_gen[i] != ept->view_gen[i]) {
+			vcpu->ept_view_gen[i] = ept->view_gen[i];
+			vcpu_invept_view(vcpu, i);
+		}
+	}
+
+	return true;
+}
+
+/* Root mode only, call after updating the EPT.  */
+static inline void vcpu_invept(struct vcpu *vcpu)
+{
+	if (!vcpu_sync_ept(vcpu))
+		++vcpu->invept_avoided;
+}
+
 struct h_vmfunc {
 	u32 eptp;
 	u32 func;
@@ -599,24 +1028,47 @@ typedef HANDLE pid_t;
 
 extern int ksm_sandbox_init(struct ksm *k);
 extern int ksm_sandbox_exit(struct ksm *k);
-extern bool ksm_sandbox_handle_ept(struct ept *ept, int dpl, u64 gpa,
+extern void ksm_sandbox_unbox_all(struct ksm *k);
+extern bool ksm_sandbox_handle_ept(struct vcpu *vcpu, int dpl, u64 gpa,
 				   u64 gva, u64 cr3, u16 curr, u8 ar, u8 ac,
 				   bool *invd, u16 *eptp_switch);
 extern void ksm_sandbox_handle_cr3(struct vcpu *vcpu, u64 cr3);
 extern bool ksm_sandbox_handle_vmcall(struct vcpu *vcpu, uintptr_t arg);
+extern bool ksm_sandbox_handle_new(struct vcpu *vcpu, uintptr_t arg);
+extern bool ksm_sandbox_handle_free(struct vcpu *vcpu, uintptr_t arg);
+extern bool ksm_sandbox_handle_snap(struct vcpu *vcpu, uintptr_t arg);
+extern bool ksm_sandbox_handle_reset(struct vcpu *vcpu, uintptr_t arg);
+extern bool ksm_sandbox_handle_dedup(struct vcpu *vcpu, uintptr_t arg);
+extern u32 ksm_sandbox_cpu_ctl(struct vcpu *vcpu, u32 ctl, u32 msr);
 extern int ksm_sandbox(struct ksm *k, pid_t pid);
 extern int ksm_unbox(struct ksm *k, pid_t pid);
+extern int ksm_unbox_group(struct ksm *k, pid_t pid);
+extern int ksm_sandbox_group(struct ksm *k, struct ksm_sandbox_group *req);
+extern int ksm_sandbox_snapshot(struct ksm *k, pid_t pid);
+extern int ksm_sandbox_reset(struct ksm *k, pid_t pid);
+extern int ksm_sandbox_fault_around(struct ksm *k, struct ksm_sandbox_fa *req);
+extern int ksm_sandbox_limit(struct ksm *k, struct ksm_sandbox_limit *req);
+extern int ksm_sandbox_dedup_stats(struct ksm *k, struct ksm_sandbox_dedup *req);
 #endif
 
 /* vcpu.c  */
 extern int vcpu_init(struct vcpu *vcpu);
 extern void vcpu_free(struct vcpu *vcpu);
 extern void vcpu_switch_root_eptp(struct vcpu *vcpu, u16 index);
-extern u64 *ept_alloc_page(u64 *pml4, int access, u64 gpa, u64 hpa);
+extern u64 *ept_alloc_page(struct ept *ept, u16 eptp, int access, u64 gpa, u64 hpa);
+extern u64 *__ept_pte(u64 *pml4, u64 gpa, int *level);
 extern u64 *ept_pte(u64 *pml4, u64 gpa);
+extern u64 *ept_split_pte(struct ept *ept, u16 eptp, u64 gpa);
+extern int ept_set_ar_range(struct ept *ept, const struct ept_ar_op *ops, int count,
+			    int *skipped);
+extern int ksm_set_ar_range(const struct ept_ar_op *ops, int count);
 extern bool ept_handle_violation(struct vcpu *vcpu);
 extern bool ept_create_ptr(struct ept *ept, int access, u16 *out_eptp);
 extern void ept_free_ptr(struct ept *ept, u16 eptp);
+#ifdef SHARED_EPT
+extern int ksm_init_ept(struct ksm *k);
+extern void ksm_free_ept(struct ksm *k);
+#endif
 
 static inline void __set_epte_pfn(u64 *epte, u64 pfn)
 {
@@ -643,42 +1095,45 @@ static inline void __set_epte_ar_pfn(u64 *epte, int ar, u64 pfn)
 
 static inline void ept_set_hpa(struct ept *ept, int eptp, u64 gpa, u64 hpa)
 {
-	u64 *epte = ept_pte(EPT4(ept, eptp), gpa);
-	if (epte)
+	u64 *epte;
+
+	ept_lock(ept);
+	epte = ept_split_pte(ept, eptp, gpa);
+	if (epte) {
 		__set_epte_pfn(epte, hpa >> PAGE_SHIFT);
+		ept_flush(ept, eptp);
+	}
+	ept_unlock(ept);
 }
 
 static inline void ept_set_ar(struct ept *ept, int eptp, u64 gpa, int ar)
 {
-	u64 *epte = ept_pte(EPT4(ept, eptp), gpa);
-	if (epte)
+	u64 *epte;
+
+	ept_lock(ept);
+	epte = ept_split_pte(ept, eptp, gpa);
+	if (epte) {
 		__set_epte_ar(epte, ar);
+		ept_flush(ept, eptp);
+	}
+	ept_unlock(ept);
 }
 
 static inline bool ept_gpa_to_hpa(struct ept *ept, int eptp, u64 gpa, u64 *hpa)
 {
-	u64 *epte = ept_pte(EPT4(ept, eptp), gpa);
-	if (!(*epte & EPT_AR_MASK))
+	int level;
+	u64 *epte = __ept_pte(EPT4(ept, eptp), gpa, &level);
+	if (!epte || !(*epte & EPT_AR_MASK))
 		return false;
 
-	*hpa = PAGE_PA(*epte);
-	return true;
-}
-
-static inline bool gva_to_gpa(struct vcpu *vcpu, uintptr_t cr3,
-			      uintptr_t gva, u32 ac, u64 *gpa)
-{
-	pte_t *pte = pte_from_cr3_va(cr3, gva);
-	if (!pte || (pte->pte & ac) != ac)
-		return false;
-
-	*gpa = PAGE_PA(pte->pte);
+	/* Large leaves need the offset of the 4 KB page within them.  */
+	*hpa = PAGE_PA(*epte) + (gpa & (ept_level_size(level) - 1) & ~(PAGE_SIZE - 1));
 	return true;
 }
 
 static inline bool gpa_to_hpa(struct vcpu *vcpu, u64 gpa, u64 *hpa)
 {
-	return ept_gpa_to_hpa(&vcpu->ept, vcpu_eptp_idx(vcpu), gpa, hpa);
+	return ept_gpa_to_hpa(vcpu_ept(vcpu), vcpu_eptp_idx(vcpu), gpa, hpa);
 }
 
 static inline void ar_get_bits(u8 ar, char *p)
@@ -719,4 +1174,97 @@ static void unregister_power_callback(void) { }
 extern int register_cpu_callback(void);
 extern void unregister_cpu_callback(void);
 
+/* reserve.c  */
+extern int ksm_reserve_init(struct ksm *k);
+extern void ksm_reserve_exit(struct ksm *k);
+extern void vcpu_reserve_init(struct vcpu *vcpu);
+extern void vcpu_reserve_free(struct vcpu *vcpu);
+extern void *vcpu_alloc_page(struct vcpu *vcpu);
+extern void vcpu_free_page(struct vcpu *vcpu, void *page);
+extern void *ksm_alloc_page(void);
+extern void ksm_free_page(void *page);
+
+/* mm.c  */
+extern int ksm_map_init(struct ksm *k);
+extern void ksm_map_exit(struct ksm *k);
+extern void *vcpu_map_page(struct vcpu *vcpu, u64 hpa);
+extern void vcpu_unmap_page(struct vcpu *vcpu, void *va);
+extern bool gva_to_gpa(struct vcpu *vcpu, uintptr_t cr3,
+		       uintptr_t gva, u32 ac, u64 *gpa);
+
+static inline void vcpu_flush_gtlb(struct vcpu *vcpu)
+{
+	struct gtlb *tlb = &vcpu->tlb;
+	if (++tlb->gen == 0) {
+		memset(tlb->e, 0, sizeof(tlb->e));
+		tlb->gen = 1;
+	}
+}
+
+static inline void vcpu_flush_gtlb_addr(struct vcpu *vcpu, uintptr_t gva)
+{
+	u64 vpn = gva >> PAGE_SHIFT;
+	struct gtlb_entry *e = &vcpu->tlb.e[vpn & (GTLB_SIZE - 1)];
+	if (e->vpn == vpn)
+		e->gen = 0;
+}
+
+/*
+ * Translations can only be kept across VM-exits if we see every INVLPG and
+ * CR3 load the guest does, otherwise they're only good for the current one.
+ */
+static inline void vcpu_sync_gtlb(struct vcpu *vcpu)
+{
+	const u32 need = CPU_BASED_INVLPG_EXITING | CPU_BASED_CR3_LOAD_EXITING;
+	if ((vcpu->cpu_ctl & need) != need)
+		vcpu_flush_gtlb(vcpu);
+}
+
+/* slab.c  */
+#define CACHE_ALIGN			16
+#define CACHE_MAG_SIZE			32			/* free objects kept per CPU  */
+
+struct obj_mag {
+	volatile u64 top;
+	volatile s32 count;
+};
+
+/* See slab.c  */
+struct obj_cache {
+	const char *name;
+	size_t size;
+	struct obj_mag mag[KSM_MAX_VCPUS];
+	volatile u64 depot;
+	void *volatile slabs;
+	volatile s32 live;	/* objects in use  */
+	volatile s32 peak;	/* max objects ever in use at once  */
+	volatile s32 nr_slabs;	/* pages carved  */
+	volatile u32 registered;
+	struct obj_cache *next;
+};
+
+#define DEFINE_OBJ_CACHE(cache, type)		\
+	struct obj_cache cache = {		\
+		.name = #type,			\
+		.size = sizeof(type),		\
+	}
+
+extern void *cache_alloc(struct obj_cache *c);
+extern void cache_free(struct obj_cache *c, void *obj);
+extern void ksm_slab_exit(void);
+
+/* trace.c  */
+#ifdef ENABLE_TRACE
+extern int ksm_trace_init(struct ksm *k);
+extern void ksm_trace_exit(struct ksm *k);
+extern void vcpu_trace(struct vcpu *vcpu, u32 reason);
+#ifdef __linux__
+struct vm_area_struct;
+extern int ksm_trace_mmap(struct ksm *k, struct vm_area_struct *vma);
+#endif
+#else
+static inline int ksm_trace_init(struct ksm *k) { return 0; }
+static inline void ksm_trace_exit(struct ksm *k) { }
+#endif
+
 #endif
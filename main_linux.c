@@ -29,6 +29,89 @@ static struct mm_struct *mm = NULL;
 static int major_no = 0;
 static struct class *class;
 
+#ifdef ENABLE_STATS
+static int ksm_ioctl_stats(struct ksm_stats_req __user *req)
+{
+	struct ksm_exit_stats *stats;
+	int cpu;
+	int ret;
+
+	if (copy_from_user(&cpu, &req->cpu, sizeof(cpu)))
+		return -EFAULT;
+
+	/* Too big for the stack.  */
+	stats = mm_alloc_pool(sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	ret = ksm_read_stats(ksm, cpu, stats);
+	if (ret == 0 && copy_to_user(&req->stats, stats, sizeof(*stats)))
+		ret = -EFAULT;
+
+	mm_free_pool(stats, sizeof(*stats));
+	return ret;
+}
+#endif
+
+#ifdef PMEM_SANDBOX
+static int ksm_ioctl_fault_around(struct ksm_sandbox_fa __user *ureq)
+{
+	struct ksm_sandbox_fa req;
+	int ret;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	ret = ksm_sandbox_fault_around(ksm, &req);
+	if (ret == 0 && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+static int ksm_ioctl_limit(struct ksm_sandbox_limit __user *ureq)
+{
+	struct ksm_sandbox_limit req;
+	int ret;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	ret = ksm_sandbox_limit(ksm, &req);
+	if (ret == 0 && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+static int ksm_ioctl_group(struct ksm_sandbox_group __user *ureq)
+{
+	struct ksm_sandbox_group req;
+	int ret;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	ret = ksm_sandbox_group(ksm, &req);
+	if (ret == 0 && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+static int ksm_ioctl_dedup(struct ksm_sandbox_dedup __user *ureq)
+{
+	struct ksm_sandbox_dedup req;
+	int ret;
+
+	ret = ksm_sandbox_dedup_stats(ksm, &req);
+	if (ret == 0 && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+#endif
+
 static long ksm_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 {
 	int ret = -EINVAL;
@@ -44,21 +127,62 @@ static long ksm_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 	switch (cmd) {
 #ifdef PMEM_SANDBOX
 	case KSM_IOCTL_SANDBOX:
-		ret = copy_from_user(&pid, (const void __force *)args, sizeof(pid));
-		if (ret < 0)
+		if (copy_from_user(&pid, (const void __force *)args, sizeof(pid))) {
+			ret = -EFAULT;
 			break;
+		}
 
 		KSM_DEBUG("sandboxing %d\n", pid);
 		ret = ksm_sandbox(ksm, pid);
 		break;
 	case KSM_IOCTL_UNBOX:
-		ret = copy_from_user(&pid, (const void __force *)args, sizeof(pid));
-		if (ret < 0)
+		if (copy_from_user(&pid, (const void __force *)args, sizeof(pid))) {
+			ret = -EFAULT;
 			break;
+		}
 
 		KSM_DEBUG("unsandboxing %d\n", pid);
 		ret = ksm_unbox(ksm, pid);
 		break;
+	case KSM_IOCTL_SNAPSHOT:
+		if (copy_from_user(&pid, (const void __force *)args, sizeof(pid))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		KSM_DEBUG("snapshot of %d\n", pid);
+		ret = ksm_sandbox_snapshot(ksm, pid);
+		break;
+	case KSM_IOCTL_RESET:
+		if (copy_from_user(&pid, (const void __force *)args, sizeof(pid))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		KSM_DEBUG("resetting %d\n", pid);
+		ret = ksm_sandbox_reset(ksm, pid);
+		break;
+	case KSM_IOCTL_FAULT_AROUND:
+		ret = ksm_ioctl_fault_around((struct ksm_sandbox_fa __user *)args);
+		break;
+	case KSM_IOCTL_SANDBOX_LIMIT:
+		ret = ksm_ioctl_limit((struct ksm_sandbox_limit __user *)args);
+		break;
+	case KSM_IOCTL_SANDBOX_DEDUP:
+		ret = ksm_ioctl_dedup((struct ksm_sandbox_dedup __user *)args);
+		break;
+	case KSM_IOCTL_SANDBOX_GROUP:
+		ret = ksm_ioctl_group((struct ksm_sandbox_group __user *)args);
+		break;
+	case KSM_IOCTL_UNBOX_GROUP:
+		if (copy_from_user(&pid, (const void __force *)args, sizeof(pid))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		KSM_DEBUG("unsandboxing the group of %d\n", pid);
+		ret = ksm_unbox_group(ksm, pid);
+		break;
 #endif
 	case KSM_IOCTL_SUBVERT:
 		if (!mm) {
@@ -79,6 +203,11 @@ static long ksm_ioctl(struct file *filp, unsigned int cmd, unsigned long args)
 		}
 
 		break;
+#ifdef ENABLE_STATS
+	case KSM_IOCTL_STATS:
+		ret = ksm_ioctl_stats((struct ksm_stats_req __user *)args);
+		break;
+#endif
 	default:
 		KSM_DEBUG("unknown ioctl code %X\n", cmd);
 		ret = -EINVAL;
@@ -102,10 +231,21 @@ static int ksm_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+#ifdef ENABLE_TRACE
+static int ksm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	return ksm_trace_mmap(ksm, vma);
+}
+#endif
+
 static struct file_operations ksm_fops = {
+	.owner = THIS_MODULE,
 	.open = ksm_open,
 	.release = ksm_release,
 	.unlocked_ioctl = ksm_ioctl,
+#ifdef ENABLE_TRACE
+	.mmap = ksm_mmap,
+#endif
 };
 
 static int ksm_reboot(struct notifier_block *nb, unsigned long action,
@@ -119,6 +119,7 @@ static NTSTATUS DriverDispatch(PDEVICE_OBJECT deviceObject, PIRP irp)
 	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
 	void *buf = irp->AssociatedIrp.SystemBuffer;
 	u32 inlen = stack->Parameters.DeviceIoControl.InputBufferLength;
+	u32 outlen = stack->Parameters.DeviceIoControl.OutputBufferLength;
 	u32 ioctl;
 
 	switch (stack->MajorFunction) {
@@ -134,6 +135,58 @@ static NTSTATUS DriverDispatch(PDEVICE_OBJECT deviceObject, PIRP irp)
 		case KSM_IOCTL_UNBOX:
 			status = ksm_unbox(ksm, (pid_t)(*(int *)buf));
 			break;
+		case KSM_IOCTL_SNAPSHOT:
+			status = ksm_sandbox_snapshot(ksm, (pid_t)(*(int *)buf));
+			break;
+		case KSM_IOCTL_RESET:
+			status = ksm_sandbox_reset(ksm, (pid_t)(*(int *)buf));
+			break;
+		case KSM_IOCTL_FAULT_AROUND:
+			if (inlen < sizeof(struct ksm_sandbox_fa) ||
+			    outlen < sizeof(struct ksm_sandbox_fa)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			status = ksm_sandbox_fault_around(ksm, buf);
+			if (NT_SUCCESS(status))
+				irp->IoStatus.Information = sizeof(struct ksm_sandbox_fa);
+			break;
+		case KSM_IOCTL_SANDBOX_LIMIT:
+			if (inlen < sizeof(struct ksm_sandbox_limit) ||
+			    outlen < sizeof(struct ksm_sandbox_limit)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			status = ksm_sandbox_limit(ksm, buf);
+			if (NT_SUCCESS(status))
+				irp->IoStatus.Information = sizeof(struct ksm_sandbox_limit);
+			break;
+		case KSM_IOCTL_SANDBOX_DEDUP:
+			if (outlen < sizeof(struct ksm_sandbox_dedup)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			status = ksm_sandbox_dedup_stats(ksm, buf);
+			if (NT_SUCCESS(status))
+				irp->IoStatus.Information = sizeof(struct ksm_sandbox_dedup);
+			break;
+		case KSM_IOCTL_SANDBOX_GROUP:
+			if (inlen < sizeof(struct ksm_sandbox_group) ||
+			    outlen < sizeof(struct ksm_sandbox_group)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			status = ksm_sandbox_group(ksm, buf);
+			if (NT_SUCCESS(status))
+				irp->IoStatus.Information = sizeof(struct ksm_sandbox_group);
+			break;
+		case KSM_IOCTL_UNBOX_GROUP:
+			status = ksm_unbox_group(ksm, (pid_t)(*(int *)buf));
+			break;
 #endif
 		case KSM_IOCTL_SUBVERT:
 			status = ksm_subvert(ksm);
@@ -141,6 +194,19 @@ static NTSTATUS DriverDispatch(PDEVICE_OBJECT deviceObject, PIRP irp)
 		case KSM_IOCTL_UNSUBVERT:
 			status = ksm_unsubvert(ksm);
 			break;
+#ifdef ENABLE_STATS
+		case KSM_IOCTL_STATS:
+			if (inlen < sizeof(int) || outlen < sizeof(struct ksm_stats_req)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				break;
+			}
+
+			status = ksm_read_stats(ksm, *(int *)buf,
+						&((struct ksm_stats_req *)buf)->stats);
+			if (NT_SUCCESS(status))
+				irp->IoStatus.Information = sizeof(struct ksm_stats_req);
+			break;
+#endif
 		default:
 			status = STATUS_NOT_SUPPORTED;
 			break;
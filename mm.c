@@ -24,6 +24,7 @@
 #include <linux/vmalloc.h>
 #include <linux/io.h>
 #include <linux/ioport.h>
+#include <linux/hash.h>
 #else
 #include <ntddk.h>
 #endif
@@ -35,23 +36,75 @@
 #ifdef __linux__
 extern struct resource iomem_resource;
 
+/*
+ * Mappings made by mm_remap() are indexed both by virtual address (for
+ * mm_unmap()) and by physical range, so that mapping the same range again
+ * just takes a reference to the existing mapping instead of building a new
+ * one, this is mostly for long-lived mappings such as the nested VMCS.
+ *
+ * Both indexes are fixed-size hash tables of hlists, so adding and removing
+ * never allocates, and the lock only covers a few pointer updates, the
+ * expensive part (building the mapping) is done outside of it.
+ */
+#define REMAP_HASH_BITS		8
+
 struct remap_region {
 	struct vm_struct *area;
-	struct list_head link;
+	u64 phys;			/* page aligned  */
+	size_t size;			/* page aligned  */
+	int refs;
+	struct hlist_node va_link;
+	struct hlist_node pa_link;
 };
-static LIST_HEAD(remap_list);
+static struct hlist_head remap_va[1 << REMAP_HASH_BITS];
+static struct hlist_head remap_pa[1 << REMAP_HASH_BITS];
+static DEFINE_SPINLOCK(remap_lock);
+static DEFINE_OBJ_CACHE(remap_cache, struct remap_region);
+
+static inline struct hlist_head *remap_bucket(struct hlist_head *table, u64 addr)
+{
+	return &table[hash_64(addr >> PAGE_SHIFT, REMAP_HASH_BITS)];
+}
 
 static inline struct remap_region *find_remap_region(void *addr)
 {
 	struct remap_region *r;
 
-	list_for_each_entry(r, &remap_list, link)
+	hlist_for_each_entry(r, remap_bucket(remap_va, (u64)addr), va_link)
 		if (r->area->addr == addr)
 			return r;
 
 	return NULL;
 }
 
+static inline struct remap_region *find_remap_phys(u64 phys, size_t size)
+{
+	struct remap_region *r;
+
+	hlist_for_each_entry(r, remap_bucket(remap_pa, phys), pa_link)
+		if (r->phys == phys && r->size == size)
+			return r;
+
+	return NULL;
+}
+
+/* Take a reference to an existing mapping of [@phys, @phys + @size)  */
+static inline void *remap_get(u64 phys, size_t size)
+{
+	struct remap_region *region;
+	unsigned long flags;
+	void *addr = NULL;
+
+	spin_lock_irqsave(&remap_lock, flags);
+	region = find_remap_phys(phys, size);
+	if (region) {
+		++region->refs;
+		addr = region->area->addr;
+	}
+	spin_unlock_irqrestore(&remap_lock, flags);
+	return addr;
+}
+
 void *mm_remap(u64 phys, size_t size)
 {
 	/*
@@ -66,12 +119,22 @@ void *mm_remap(u64 phys, size_t size)
 	 * This is guaranteed to allocate via swappers PGD (init_mm).
 	 */
 	unsigned long vaddr;
-	unsigned long last;
 	unsigned long offset;
+	unsigned long flags;
 	struct vm_struct *area;
 	struct remap_region *region;
+	struct remap_region *other;
+	void *addr;
+
+	offset = phys & ~PAGE_MASK;
+	phys &= PHYSICAL_PAGE_MASK;
+	size = PAGE_ALIGN(offset + size);
+
+	addr = remap_get(phys, size);
+	if (addr)
+		return (char *)addr + offset;
 
-	region = mm_alloc_pool(sizeof(*region));
+	region = cache_alloc(&remap_cache);
 	if (!region)
 		return NULL;
 
@@ -79,11 +142,6 @@ void *mm_remap(u64 phys, size_t size)
 	if (!area)
 		goto err_region;
 
-	offset = phys & ~PAGE_MASK;
-	phys &= PHYSICAL_PAGE_MASK;
-	last = phys + size - 1;
-	size = PAGE_ALIGN(last + 1) - phys;
-
 	area->phys_addr = phys;
 	vaddr = (unsigned long)area->addr;
 
@@ -92,31 +150,62 @@ void *mm_remap(u64 phys, size_t size)
 		goto err_area;
 
 	region->area = area;
-	list_add(&region->link, &remap_list);
+	region->phys = phys;
+	region->size = size;
+	region->refs = 1;
+
+	spin_lock_irqsave(&remap_lock, flags);
+	other = find_remap_phys(phys, size);
+	if (other) {
+		/* Someone else mapped it in the meantime, use theirs.  */
+		++other->refs;
+		vaddr = (unsigned long)other->area->addr;
+	} else {
+		hlist_add_head(&region->va_link, remap_bucket(remap_va, vaddr));
+		hlist_add_head(&region->pa_link, remap_bucket(remap_pa, phys));
+	}
+	spin_unlock_irqrestore(&remap_lock, flags);
+
+	if (other) {
+		free_vm_area(area);
+		cache_free(&remap_cache, region);
+	}
+
 	return (void *)(vaddr + offset);
 
 err_area:
 	free_vm_area(area);
 err_region:
-	mm_free_pool(region, sizeof(*region));
+	cache_free(&remap_cache, region);
 	return NULL;
 }
 
 void mm_unmap(void *vaddr, size_t size)
 {
 	struct remap_region *region;
+	unsigned long flags;
 	void *addr = (void *)((unsigned long)vaddr & PAGE_MASK);
 
+	spin_lock_irqsave(&remap_lock, flags);
 	region = find_remap_region(addr);
 	if (!region) {
+		spin_unlock_irqrestore(&remap_lock, flags);
 		printk(KERN_ERR "mm_unmap(): bad address %p\n", addr);
 		dump_stack();
 		return;
 	}
 
+	if (--region->refs != 0) {
+		spin_unlock_irqrestore(&remap_lock, flags);
+		return;
+	}
+
+	hlist_del(&region->va_link);
+	hlist_del(&region->pa_link);
+	spin_unlock_irqrestore(&remap_lock, flags);
+
 	free_vm_area(region->area);
-	list_del(&region->link);
-	mm_free_pool(region, sizeof(*region));
+	cache_free(&remap_cache, region);
 }
 
 /*
@@ -183,7 +272,7 @@ static void iter_resource(struct pmem_range *ranges,
 	for (tmp = resource; tmp && *curr < MAX_RANGES; tmp = tmp->child) {
 		if (strcmp(tmp->name, match) == 0) {
 			ranges[*curr].start = tmp->start;
-			ranges[*curr].end = tmp->end;
+			ranges[*curr].end = tmp->end + 1;	/* resource ends are inclusive  */
 			++*curr;
 		}
 
@@ -226,3 +315,215 @@ int mm_cache_ram_ranges(struct pmem_range *ranges, int *range_count)
 }
 #endif
 
+
+/*
+ * Per-vCPU physical mapping windows, a kmap_atomic() for VMX root mode.
+ *
+ * Mapping a guest page with mm_remap() means carving out virtual address
+ * space and building page tables for it (and tearing them down again), every
+ * single time, which is way too slow for something done on most VM-exits that
+ * touch guest memory, and not safe to do from root mode to begin with.
+ *
+ * Instead, each vCPU owns MAP_SLOTS pages of address space whose PTEs are
+ * known, pointing a slot at a frame is just a PTE write and an INVLPG, no
+ * other CPU ever touches that VA so no shootdown is needed either.  On Linux,
+ * RAM frames are simply accessed via the direct map.
+ *
+ * Root mode only: interrupts are disabled, so slots are just used like a
+ * stack, unmap in the reverse order of map.
+ */
+#define MAP_WINDOW_SIZE		(KSM_MAX_VCPUS * MAP_SLOTS * PAGE_SIZE)
+#define MAP_WINDOW_TAG		'wmsk'
+
+int ksm_map_init(struct ksm *k)
+{
+	struct map_window *w;
+	uintptr_t va;
+	int i;
+	int j;
+#ifdef __linux__
+	struct vm_struct *area;
+	pte_t **ptes;
+
+	ptes = mm_alloc_pool(KSM_MAX_VCPUS * MAP_SLOTS * sizeof(*ptes));
+	if (!ptes)
+		return ERR_NOMEM;
+
+	/* This populates the page tables, so the PTEs won't move.  */
+	area = alloc_vm_area(MAP_WINDOW_SIZE, ptes);
+	if (!area) {
+		__mm_free_pool(ptes);
+		return ERR_NOMEM;
+	}
+
+	k->map_area = area;
+	va = (uintptr_t)area->addr;
+#else
+	va = (uintptr_t)MmAllocateMappingAddress(MAP_WINDOW_SIZE, MAP_WINDOW_TAG);
+	if (!va)
+		return ERR_NOMEM;
+
+	k->map_area = (void *)va;
+#endif
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		w = &ksm_cpu_at(k, i)->map;
+		w->va = va + i * MAP_SLOTS * PAGE_SIZE;
+		w->top = 0;
+
+		for (j = 0; j < MAP_SLOTS; ++j) {
+#ifdef __linux__
+			w->pte[j] = ptes[i * MAP_SLOTS + j];
+#else
+			w->pte[j] = va_to_pte(w->va + j * PAGE_SIZE);
+#endif
+		}
+	}
+
+#ifdef __linux__
+	__mm_free_pool(ptes);
+#endif
+	return 0;
+}
+
+void ksm_map_exit(struct ksm *k)
+{
+	struct map_window *w;
+	int i;
+	int j;
+
+	if (!k->map_area)
+		return;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		w = &ksm_cpu_at(k, i)->map;
+		for (j = 0; j < MAP_SLOTS; ++j)
+			w->pte[j]->pte = 0;
+	}
+
+#ifdef __linux__
+	free_vm_area(k->map_area);
+#else
+	MmFreeMappingAddress(k->map_area, MAP_WINDOW_TAG);
+#endif
+	k->map_area = NULL;
+}
+
+/*
+ * Map the page @hpa lives in, and return the VA @hpa is at.  Returns NULL if
+ * all slots are in use.
+ */
+void *vcpu_map_page(struct vcpu *vcpu, u64 hpa)
+{
+	struct map_window *w = &vcpu->map;
+	bool ram = ksm_is_ram(vcpu_to_ksm(vcpu), hpa);
+	uintptr_t va;
+	int slot;
+
+#ifdef __linux__
+	if (ram)
+		return __va(hpa);
+#endif
+
+	if (w->top == MAP_SLOTS)
+		return NULL;
+
+	slot = w->top++;
+	va = w->va + slot * PAGE_SIZE;
+	w->pte[slot]->pte = PAGE_PA(hpa) | PAGE_PRESENT | PAGE_WRITE |
+		PAGE_ACCESSED | PAGE_DIRTY | PAGE_NX |
+		(ram ? 0 : PAGE_CACHEDISABLE | PAGE_WRITETHRU);
+	__invlpg((void *)va);
+	return (void *)(va + addr_offset(hpa));
+}
+
+void vcpu_unmap_page(struct vcpu *vcpu, void *va)
+{
+	struct map_window *w = &vcpu->map;
+	uintptr_t addr = page_align(va);
+
+	/* Direct map  */
+	if (addr < w->va || addr >= w->va + MAP_SLOTS * PAGE_SIZE)
+		return;
+
+	BUG_ON(w->va + (w->top - 1) * PAGE_SIZE != addr);
+	--w->top;
+}
+
+/*
+ * Walk the guest's own paging structures (4-level) for @gva, reading them
+ * through the mapping window, large pages are supported at every level.
+ * Returns the guest physical page and the permissions of all levels combined.
+ */
+static bool guest_walk(struct vcpu *vcpu, u64 cr3, u64 gva, u64 *gpa, u32 *flags)
+{
+	static const int shift[] = { PTI_SHIFT, PDI_SHIFT, PPI_SHIFT, PXI_SHIFT };
+	u64 table = PAGE_PA(cr3);
+	u32 eff = PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+	u64 entry;
+	u64 size;
+	u64 hpa;
+	u64 *va;
+	int level;
+
+	for (level = 3; level >= 0; --level) {
+		if (!gpa_to_hpa(vcpu, table, &hpa))
+			return false;
+
+		va = vcpu_map_page(vcpu, hpa);
+		if (!va)
+			return false;
+
+		entry = va[(gva >> shift[level]) & PTX_MASK];
+		vcpu_unmap_page(vcpu, va);
+		if (!(entry & PAGE_PRESENT))
+			return false;
+
+		eff &= (u32)entry;
+		if (level == 0 || (level < 3 && entry & PAGE_LARGE)) {
+			size = 1ULL << shift[level];
+			*gpa = (PAGE_PA(entry) & ~(size - 1)) | (gva & (size - 1) & ~(PAGE_SIZE - 1));
+			*flags = eff;
+			return true;
+		}
+
+		table = PAGE_PA(entry);
+	}
+
+	return false;
+}
+
+/*
+ * Translate @gva in the address space @cr3 to a guest physical page, @ac is
+ * the access needed, e.g. PAGE_PRESENT | PAGE_WRITE.  Root mode only.
+ *
+ * Translations are cached in a small direct-mapped software TLB, flushed on
+ * INVLPG, CR3 and CR4 writes, see vcpu_sync_gtlb() for when it's valid.
+ */
+bool gva_to_gpa(struct vcpu *vcpu, uintptr_t cr3, uintptr_t gva, u32 ac, u64 *gpa)
+{
+	struct gtlb *tlb = &vcpu->tlb;
+	struct gtlb_entry *e;
+	u64 vpn = gva >> PAGE_SHIFT;
+	u64 tag = cr3 & ~X86_CR3_PCID_NOFLUSH;
+	u64 pa;
+	u32 flags;
+
+	e = &tlb->e[vpn & (GTLB_SIZE - 1)];
+	if (e->gen != tlb->gen || e->cr3 != tag || e->vpn != vpn) {
+		if (!guest_walk(vcpu, cr3, gva, &pa, &flags))
+			return false;
+
+		e->cr3 = tag;
+		e->vpn = vpn;
+		e->gpa = pa;
+		e->flags = flags;
+		e->gen = tlb->gen;
+	}
+
+	if ((e->flags & ac) != ac)
+		return false;
+
+	*gpa = e->gpa;
+	return true;
+}
@@ -198,13 +198,18 @@ static inline void __stosq(unsigned long long *a, unsigned long x, unsigned long
 	memset(a, x, count << 3);
 }
 
+static inline void __movsb(unsigned char *d, const unsigned char *s, size_t n)
+{
+	__asm __volatile("rep movsb" : "+D" (d), "+S" (s), "+c" (n) : : "memory");
+}
+
 static inline pte_t *pte_from_cr3_va(uintptr_t cr3, uintptr_t va)
 {
 	pgd_t *pgd;
 	pud_t *pud;
 	pmd_t *pmd;
 
-	pgd = pgd_offset(current->mm, va);
+	pgd = (pgd_t *)__va(PAGE_PA(cr3)) + pgd_index(va);
 	if (pgd_none(*pgd) || pgd_bad(*pgd))
 		return NULL;
 
@@ -250,6 +255,16 @@ static inline bool mm_is_kernel_addr(void *va)
 	return (uintptr_t)va >= PAGE_OFFSET;
 }
 
+/*
+ * Whether all (1), none (0) or only some (-1) of the physical range
+ * [@pa, @pa + @size) is mapped at a kernel address.  All of it is, the
+ * direct map covers the whole physical address space.
+ */
+static inline int mm_kernel_range(u64 pa, u64 size)
+{
+	return 1;
+}
+
 extern void *mm_remap(u64 phys, size_t size);
 extern void mm_unmap(void *addr, size_t size);
 extern void *kmap_virt(void *addr, size_t len, pgprot_t prot);
@@ -387,6 +402,24 @@ static inline bool mm_is_kernel_addr(void *va)
 {
 	return va >= MmSystemRangeStart;
 }
+
+/*
+ * Whether all (1), none (0) or only some (-1) of the physical range
+ * [@pa, @pa + @size) is mapped at a kernel address.  There is no map of
+ * that to look up, it's wherever each page is mapped right now, so this
+ * stops at the first page that differs from the first one.
+ */
+static inline int mm_kernel_range(u64 pa, u64 size)
+{
+	bool first = mm_is_kernel_addr(__va(pa));
+	u64 end = pa + size;
+
+	for (pa += PAGE_SIZE; pa < end; pa += PAGE_SIZE)
+		if (mm_is_kernel_addr(__va(pa)) != first)
+			return -1;
+
+	return first;
+}
 #endif
 
 static inline void mm_free_pool(void *v, size_t size)
@@ -397,6 +430,16 @@ static inline void mm_free_pool(void *v, size_t size)
 	__mm_free_pool(v);
 }
 
+/*
+ * Copy a whole page with a single "rep movsb", which is the fastest on
+ * anything with ERMSB (Ivy Bridge and later).  Non-temporal stores would be
+ * a loss here: the copy is almost always written to right after.
+ */
+static inline void mm_copy_page(void *dst, const void *src)
+{
+	__movsb((unsigned char *)dst, (const unsigned char *)src, PAGE_SIZE);
+}
+
 static inline void *pte_to_va(pte_t *pte)
 {
 	return (void *)__pte_to_va(pte);
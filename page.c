@@ -27,6 +27,8 @@
 #include "ksm.h"
 #include "percpu.h"
 
+static DEFINE_OBJ_CACHE(phi_cache, struct page_hook_info);
+
 /*!
  * To use this interface, call ksm_hook_epage() on the target function,
  * e.g.:
@@ -45,12 +47,9 @@
 static inline void epage_init_eptp(struct page_hook_info *phi, struct ept *ept)
 {
 	/* Called from vmcall (exit.c)  */
-	ept_alloc_page(EPT4(ept, EPTP_EXHOOK), EPT_ACCESS_EXEC, phi->dpa, phi->cpa);
-	ept_alloc_page(EPT4(ept, EPTP_RWHOOK), EPT_ACCESS_RW, phi->dpa, phi->dpa);
-	ept_alloc_page(EPT4(ept, EPTP_NORMAL), EPT_ACCESS_EXEC, phi->dpa, phi->dpa);
-
-	__invvpid_all();
-	__invept_all();
+	ept_alloc_page(ept, EPTP_EXHOOK, EPT_ACCESS_EXEC, phi->dpa, phi->cpa);
+	ept_alloc_page(ept, EPTP_RWHOOK, EPT_ACCESS_RW, phi->dpa, phi->dpa);
+	ept_alloc_page(ept, EPTP_NORMAL, EPT_ACCESS_EXEC, phi->dpa, phi->dpa);
 }
 
 static inline u16 epage_select_eptp(struct page_hook_info *phi, u16 cur, u8 ar, u8 ac)
@@ -99,9 +98,42 @@ static void epage_init_trampoline(struct trampoline *trampo, u64 to)
 	trampo->ret = 0xC3;
 }
 
+#ifdef SHARED_EPT
+/*
+ * The EPT is shared, so update it once from this CPU, then just have the
+ * others invalidate.
+ */
+static DEFINE_DPC(__do_invept, __vmx_vmcall, HYPERCALL_INVEPT, ctx);
+static inline int do_hook_page(struct page_hook_info *phi)
+{
+	__vmx_vmcall(HYPERCALL_HOOK, phi);
+	CALL_DPC(__do_invept, NULL);
+	return DPC_RET();
+}
+
+static inline int do_unhook_page(struct page_hook_info *phi)
+{
+	__vmx_vmcall(HYPERCALL_UNHOOK, (void *)phi->dpa);
+	CALL_DPC(__do_invept, NULL);
+	return DPC_RET();
+}
+#else
 static DEFINE_DPC(__do_hook_page, __vmx_vmcall, HYPERCALL_HOOK, ctx);
 static DEFINE_DPC(__do_unhook_page, __vmx_vmcall, HYPERCALL_UNHOOK, ctx);
 
+static inline int do_hook_page(struct page_hook_info *phi)
+{
+	CALL_DPC(__do_hook_page, phi);
+	return DPC_RET();
+}
+
+static inline int do_unhook_page(struct page_hook_info *phi)
+{
+	CALL_DPC(__do_unhook_page, (void *)phi->dpa);
+	return DPC_RET();
+}
+#endif
+
 /*
  * Note!!!
  * This function is not very robust, e.g. pages that are not
@@ -211,13 +243,13 @@ int ksm_hook_epage(void *original, void *redirect)
 		return 0;
 	}
 
-	phi = mm_alloc_pool(sizeof(*phi));
+	phi = cache_alloc(&phi_cache);
 	if (!phi)
 		return ERR_NOMEM;
 
 	code_page = mm_alloc_page();
 	if (!code_page) {
-		mm_free_pool(phi, sizeof(*phi));
+		cache_free(&phi_cache, phi);
 		return ERR_NOMEM;
 	}
 
@@ -230,7 +262,7 @@ int ksm_hook_epage(void *original, void *redirect)
 	phi->origin = (u64)aligned;
 	phi->ops = &epage_ops;
 
-	CALL_DPC(__do_hook_page, phi);
+	do_hook_page(phi);
 	htable_add(&ksm->ht, page_hash(phi->origin), phi);
 	return 0;
 }
@@ -246,11 +278,11 @@ int ksm_unhook_page(struct ksm *k, void *va)
 
 int __ksm_unhook_page(struct page_hook_info *phi)
 {
-	CALL_DPC(__do_unhook_page, (void *)phi->dpa);
+	int ret = do_unhook_page(phi);
 	htable_del(&ksm->ht, page_hash(phi->origin), phi);
 	mm_free_page(phi->c_va);
-	mm_free_pool(phi, sizeof(*phi));
-	return DPC_RET();
+	cache_free(&phi_cache, phi);
+	return ret;
 }
 
 struct page_hook_info *ksm_find_page(struct ksm *k, void *va)
@@ -0,0 +1,377 @@
+/*
+ * ksm - a really simple and fast x64 hypervisor
+ * Copyright (C) 2016, 2017 Ahmed Samy <asamy@protonmail.com>
+ *
+ * Per-vCPU reserve of zeroed pages for VMX root mode.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#else
+#include <ntddk.h>
+#endif
+
+#include "ksm.h"
+#include "compiler.h"
+
+/*
+ * VM-exit handlers run with interrupts disabled, and may have interrupted
+ * the kernel anywhere, including inside the allocator itself, so calling
+ * mm_alloc_page() from there is both slow and unsafe.  Instead, each vCPU has
+ * a small ring of zeroed pages that root mode takes from (and gives back to)
+ * without taking any lock, and a kernel thread tops them up from normal
+ * context whenever they fall below RESERVE_LOW.
+ *
+ * The ring is a bounded MPMC queue (each cell carries a sequence number that
+ * tells whether it's ready to be filled or emptied), so that the refill
+ * thread, root mode and the #VE handler can all use it at the same time.
+ *
+ * Root mode never calls the system allocator: when the reserve runs dry,
+ * vcpu_alloc_page() fails (callers fail the operation or retry it on the
+ * next exit) and counts it, if that happens often, RESERVE_SIZE or
+ * RESERVE_HIGH are too small for the workload.  Pages given back while it's
+ * full are pushed on a lock-free list that the refill thread frees.
+ */
+static bool reserve_push(struct page_reserve *r, void *page)
+{
+	struct reserve_cell *cell;
+	u32 pos;
+	s32 dif;
+
+	for (;;) {
+		pos = r->enq;
+		cell = &r->cells[pos & (RESERVE_SIZE - 1)];
+		dif = (s32)(cell->seq - pos);
+		if (dif == 0 && __cas32(&r->enq, pos, pos + 1))
+			break;
+
+		/* Full  */
+		if (dif < 0)
+			return false;
+	}
+
+	cell->page = page;
+	barrier();
+	cell->seq = pos + 1;
+	return true;
+}
+
+static void *reserve_pop(struct page_reserve *r)
+{
+	struct reserve_cell *cell;
+	void *page;
+	u32 pos;
+	s32 dif;
+
+	for (;;) {
+		pos = r->deq;
+		cell = &r->cells[pos & (RESERVE_SIZE - 1)];
+		dif = (s32)(cell->seq - (pos + 1));
+		if (dif == 0 && __cas32(&r->deq, pos, pos + 1))
+			break;
+
+		/* Empty  */
+		if (dif < 0)
+			return NULL;
+	}
+
+	page = cell->page;
+	barrier();
+	cell->seq = pos + RESERVE_SIZE;
+	return page;
+}
+
+static inline u32 reserve_count(const struct page_reserve *r)
+{
+	return r->enq - r->deq;
+}
+
+/* Chain @page on the deferred list, any context.  */
+static void reserve_defer(struct page_reserve *r, void *page)
+{
+	void *head;
+
+	do {
+		head = r->deferred;
+		*(void **)page = head;
+	} while (!__cas64((volatile u64 *)&r->deferred, (u64)head, (u64)page));
+}
+
+/* Normal kernel context only.  */
+static void reserve_drain(struct page_reserve *r)
+{
+	void *page;
+	void *next;
+
+	do {
+		page = r->deferred;
+	} while (!__cas64((volatile u64 *)&r->deferred, (u64)page, 0));
+
+	for (; page; page = next) {
+		next = *(void **)page;
+		__mm_free_page(page);
+	}
+}
+
+/*
+ * Take a zeroed page, can be called from VMX root mode, NULL if the reserve
+ * is dry.  Pages obtained this way can be freed either with vcpu_free_page()
+ * or mm_free_page().
+ */
+void *vcpu_alloc_page(struct vcpu *vcpu)
+{
+	struct page_reserve *r = &vcpu->reserve;
+	void *page = reserve_pop(r);
+	if (page) {
+		++r->taken;
+		return page;
+	}
+
+	++r->dry;
+	return NULL;
+}
+
+/*
+ * Give a page back to the reserve, can be called from VMX root mode.  If the
+ * reserve is full, it's left to the refill thread to free.
+ */
+void vcpu_free_page(struct vcpu *vcpu, void *page)
+{
+	struct page_reserve *r = &vcpu->reserve;
+
+	__stosq(page, 0, PAGE_SIZE >> 3);
+	if (!r->active) {
+		/* Not virtualized, so not in root mode either.  */
+		__mm_free_page(page);
+		return;
+	}
+
+	if (reserve_push(r, page)) {
+		++r->returned;
+		return;
+	}
+
+	++r->overflow;
+	reserve_defer(r, page);
+}
+
+/*
+ * Allocate a zeroed page from whatever context we are in: the current vCPU's
+ * reserve once it's running, the system otherwise.
+ */
+void *ksm_alloc_page(void)
+{
+	struct vcpu *vcpu;
+
+	if (ksm) {
+		vcpu = ksm_current_cpu();
+		if (vcpu->subverted)
+			return vcpu_alloc_page(vcpu);
+	}
+
+	return mm_alloc_page();
+}
+
+void ksm_free_page(void *page)
+{
+	struct vcpu *vcpu;
+
+	if (ksm) {
+		vcpu = ksm_current_cpu();
+		if (vcpu->subverted)
+			return vcpu_free_page(vcpu, page);
+	}
+
+	mm_free_page(page);
+}
+
+/* Normal kernel context only.  */
+static void reserve_refill(struct page_reserve *r)
+{
+	unsigned long flags;
+	void *page;
+	bool ok;
+
+	while (reserve_count(r) < RESERVE_HIGH) {
+		page = mm_alloc_page();
+		if (!page)
+			break;
+
+		spin_lock_irqsave(&r->lock, flags);
+		ok = r->active && reserve_push(r, page);
+		if (ok)
+			++r->refilled;
+		spin_unlock_irqrestore(&r->lock, flags);
+
+		if (!ok) {
+			__mm_free_page(page);
+			break;
+		}
+	}
+}
+
+static void reserve_init(struct page_reserve *r)
+{
+	int i;
+
+	for (i = 0; i < RESERVE_SIZE; ++i)
+		r->cells[i].seq = i;
+
+	r->enq = r->deq = 0;
+	r->deferred = NULL;
+	r->active = false;
+	spin_lock_init(&r->lock);
+}
+
+/*
+ * Called from vcpu_init(), i.e. before this CPU is virtualized, fills the
+ * reserve all the way up.
+ */
+void vcpu_reserve_init(struct vcpu *vcpu)
+{
+	struct page_reserve *r = &vcpu->reserve;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	r->active = true;
+	r->taken = r->dry = r->refilled = r->returned = r->overflow = 0;
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	reserve_refill(r);
+}
+
+/* Called from vcpu_free(), i.e. after this CPU is devirtualized.  */
+void vcpu_reserve_free(struct vcpu *vcpu)
+{
+	struct page_reserve *r = &vcpu->reserve;
+	unsigned long flags;
+	void *page;
+
+	spin_lock_irqsave(&r->lock, flags);
+	r->active = false;
+	while ((page = reserve_pop(r)))
+		__mm_free_page(page);
+	spin_unlock_irqrestore(&r->lock, flags);
+	reserve_drain(r);
+
+	KSM_DEBUG("reserve: %lld taken, %lld dry, %lld refilled, %lld returned, %lld overflowed\n",
+		  r->taken, r->dry, r->refilled, r->returned, r->overflow);
+}
+
+static void reserve_refill_all(struct ksm *k)
+{
+	struct page_reserve *r;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		r = &ksm_cpu_at(k, i)->reserve;
+		if (r->deferred)
+			reserve_drain(r);
+
+		if (r->active && reserve_count(r) < RESERVE_LOW)
+			reserve_refill(r);
+	}
+}
+
+#ifdef __linux__
+static struct task_struct *refill_thread;
+
+static int reserve_thread(void *k)
+{
+	while (!kthread_should_stop()) {
+		reserve_refill_all(k);
+		msleep_interruptible(RESERVE_REFILL_MS);
+	}
+
+	return 0;
+}
+
+static inline int reserve_thread_start(struct ksm *k)
+{
+	refill_thread = kthread_run(reserve_thread, k, "ksm_reserve");
+	if (IS_ERR(refill_thread))
+		return PTR_ERR(refill_thread);
+
+	return 0;
+}
+
+static inline void reserve_thread_stop(void)
+{
+	kthread_stop(refill_thread);
+}
+#else
+static volatile bool do_exit = false;
+static volatile bool exited = false;
+
+static void reserve_thread(void *k)
+{
+	while (!do_exit) {
+		reserve_refill_all(k);
+		KeDelayExecutionThread(KernelMode, FALSE, &(LARGE_INTEGER) {
+			.QuadPart = -(10000 * RESERVE_REFILL_MS)
+		});
+	}
+
+#ifdef _MSC_VER
+	InterlockedExchange8(&exited, true);
+#else
+	__sync_bool_compare_and_swap(&exited, false, true);
+#endif
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static inline int reserve_thread_start(struct ksm *k)
+{
+	HANDLE hThread;
+	CLIENT_ID cid;
+	NTSTATUS status;
+
+	do_exit = exited = false;
+	status = PsCreateSystemThread(&hThread, STANDARD_RIGHTS_ALL,
+				      NULL, NULL, &cid,
+				      (PKSTART_ROUTINE)reserve_thread, k);
+	if (NT_SUCCESS(status))
+		ZwClose(hThread);
+
+	return status;
+}
+
+static inline void reserve_thread_stop(void)
+{
+#ifdef _MSC_VER
+	InterlockedExchange8(&do_exit, true);
+#else
+	__sync_bool_compare_and_swap(&do_exit, false, true);
+#endif
+	while (!exited)
+		cpu_relax();
+}
+#endif
+
+int ksm_reserve_init(struct ksm *k)
+{
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i)
+		reserve_init(&ksm_cpu_at(k, i)->reserve);
+
+	return reserve_thread_start(k);
+}
+
+void ksm_reserve_exit(struct ksm *k)
+{
+	reserve_thread_stop();
+}
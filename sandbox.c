@@ -21,6 +21,10 @@
 #include <linux/kernel.h>
 #include <linux/sched.h>
 #include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/tracepoint.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
 #else
 #include <ntifs.h>
 #include <intrin.h>
@@ -48,45 +52,730 @@
  *
  * Note #3:
  *	This still needs a lot of work, and is quite "barebones" for now...
- *	Some work would be perhaps replacing the cr3-load-exiting with something less
- *	costy.
+ *
+ *	CR3-load exiting is only on while the task list is not empty: it's turned
+ *	on everywhere when a task is boxed, and each vCPU turns it back off on the
+ *	first CR3 load that finds the list empty.  While it's on, loads of the
+ *	last few CR3 values that are not boxed go into the CR3-target list so
+ *	they don't exit (the target list can only suppress exits, not select
+ *	them, so it can't be filled with the boxed ones instead).  The list is
+ *	emptied while a boxed task runs, since then we must see the switch out
+ *	of it, whatever it is to, and when a new task is boxed.
+ *
+ *	With SANDBOX_VMFUNC (Linux only), there are no CR3-load exits at all:
+ *	a sched_switch probe selects the view of the next task (or the default
+ *	one) with VMFUNC from the guest, which is emulated with a VMCALL if the
+ *	CPU lacks it.  Note that while
+ *	anything is boxed, every context switch selects a view, so a view that
+ *	was switched to before (e.g. by EPAGE_HOOK) is left on the next switch.
  *
  * Note #4:
  *	Be careful with this, it's not well tested and quite frankly, may not be very
  *	good performance wise, you have been warned...
+ *
+ * Note #5:
+ *	Tasks are looked up by PGD and by PID (of one of their members, see
+ *	Note #12) from VMX root mode (and from the sched probes), so those
+ *	lookups take no lock: both indexes are fixed-size hash tables of
+ *	singly linked chains of members, and a member (and its task) is fully
+ *	set up before it's published at the head of its chains.  Writers
+ *	(boxing, unboxing, forks, exits) are serialized by task_lock, which
+ *	root mode never takes.
+ *
+ *	An unlinked member keeps its next pointers, so a reader that is on it
+ *	still gets to the end of the chain, and it's only freed after the
+ *	HYPERCALL_SA_TASK DPC came back from every CPU: that can't happen
+ *	while a CPU is still in root mode, or in the probe (interrupts are
+ *	disabled there), so nobody can be looking at it anymore.
+ *
+ *	A task is freed by whoever drops its last reference: task_list holds
+ *	one until the task is unlinked, and writers that still use it after
+ *	dropping task_lock (to run a DPC on it) take one under the lock, so
+ *	that a concurrent unbox or exit can't free it under them.
+ *
+ * Note #6:
+ *	The COW pages of a task are indexed by GFN in a radix tree of whole
+ *	pages, 9 bits per level like page tables, so finding the copy of a
+ *	page costs the same however many the task has.  The tree is only ever
+ *	added to while the task is alive, from root mode and without locks: a
+ *	missing node or copy is installed with a compare-and-swap, and the
+ *	loser frees its own, so that threads of a task faulting on the same
+ *	page from different CPUs share one copy.  It's freed in one walk with
+ *	the task.
+ *
+ * Note #7:
+ *	Each task has a single view, which all vCPUs load, so PMEM_SANDBOX
+ *	implies SHARED_EPT (see ksm.h): a COW entry is installed once, and
+ *	other vCPUs drop their stale translations of it on their next
+ *	VM-exit, like for any other update of a shared view.  The view is
+ *	created (in root mode, on whichever CPU) before the task is
+ *	published, and freed on one CPU after the HYPERCALL_SA_TASK DPC took
+ *	every CPU off it.
+ *
+ * Note #8:
+ *	A snapshot (ksm_sandbox_snapshot()) freezes the COW pages a task has
+ *	at that point: they are write-protected again, and the next write to
+ *	one of them makes a new copy of it, which keeps the frozen one in
+ *	frozen.  A reset (ksm_sandbox_reset()) puts back the frozen copy (or
+ *	the original page if there's none) of every page written since, and
+ *	frees the new ones.  Pages made since the last snapshot (or since the
+ *	task was boxed) are at the tail of the task's LRU list (see Note #10),
+ *	so that both only touch what was written in between, not the whole
+ *	tree, and neither creates a new view: the entries are updated in place, once,
+ *	and all CPUs invalidate with one DPC afterwards.  Only the last
+ *	snapshot is kept, a new one frees the frozen copies of the previous.
+ *
+ *	The task should be stopped while it's snapshot or reset, a write
+ *	racing with either may land in a page that's about to be discarded.
+ *
+ * Note #9:
+ *	Streaming writes (memset() of a big buffer, etc.) would take one exit
+ *	per page, so when a write violation lands on the virtual page right
+ *	after the previous one (or right after the last batch), the following
+ *	virtual pages are copied and mapped writable ahead of time, with the
+ *	faulting one, under one lock and one flush.  The batch doubles on each
+ *	such hit, up to the task's fa_max (see ksm_sandbox_fault_around()),
+ *	and is dropped on the first write elsewhere.  The stream is tracked
+ *	per CPU (in the vcpu), not per task: threads of the same task writing
+ *	on different CPUs would otherwise break each other's stream, and
+ *	nothing but this CPU touches it.  Pages ahead are found by walking the
+ *	guest page tables, the batch stops at the first one that isn't mapped
+ *	writable (by user mode, if the fault came from there).  Faults without
+ *	a guest linear address don't take part.  A page copied ahead no longer
+ *	sees writes made to the original by others, as if the task had
+ *	written it already.
+ *
+ * Note #10:
+ *	COW pages (frozen copies included) are accounted per task and in
+ *	total, both can be limited (see ksm_sandbox_limit()).  Writes from
+ *	kernel mode always get their copy, the kernel may not be able to
+ *	take a fault there, so limits only stop user mode.  Once a limit is
+ *	reached, the task's policy decides:
+ *	    - KSM_SANDBOX_REFUSE: the entry is left read-only, so the write
+ *	      faults again until pages are freed (reset, unbox) or the limit
+ *	      is raised, i.e. the task stalls instead of growing.
+ *	    - KSM_SANDBOX_RECLAIM: the oldest copies are scanned, and those
+ *	      that are still the same as what they were copied from are
+ *	      dropped (their entry goes back to that, read-only), which is
+ *	      what fault-around and read-mostly data leave behind.  What
+ *	      they were copied from is the frozen copy, or the frame itself
+ *	      (views are identity maps), never what the task's view maps.
+ *	      A copy that's still writable is only made read-only on the
+ *	      first scan, and compared on a later one once every vCPU
+ *	      synced past that, so a write racing with the comparison can't
+ *	      be lost: a copy is only dropped if it couldn't have been
+ *	      written since it was compared.  Idle CPUs may not exit for a
+ *	      while, but the dedup thread's DPC (see Note #11) makes them
+ *	      all sync at least every SA_DEDUP_MS.
+ *
+ *	The leaves of the COW tree are kept on task->lru in the order they
+ *	were made, which is the only access we get to see, under cow_lock,
+ *	which only root mode takes.  Pages made since the last snapshot are
+ *	always at its tail, older ones (put back by reset or reclaim) go to
+ *	its head.  A reclaimed page may still be in the TLB of other CPUs, so
+ *	it's kept on task->limbo until every vCPU synced past the EPT
+ *	generation it was unmapped at.
+ *
+ * Note #11:
+ *	Boxed processes often end up with copies of the same data (zeroed
+ *	pages, the same library pages relocated the same way, ...), so a
+ *	pass run every SA_DEDUP_MS by its own thread merges identical COW
+ *	pages, of one task or across tasks, into one read-only frame:
+ *	    1. HYPERCALL_SA_DEDUP (protect): up to SA_DEDUP_SCAN leaves that
+ *	       weren't looked at since they were last written are made
+ *	       read-only and queued on their task's dedup list.
+ *	    2. A HYPERCALL_INVEPT DPC, after which no CPU can write to them.
+ *	    3. HYPERCALL_SA_DEDUP (collect): each queued page whose entry is
+ *	       still read-only gets a frame of its own (not in the table
+ *	       yet), with a reference held by the pass, so that the frame
+ *	       can neither change (a write splits it, see get_cow_page())
+ *	       nor go away until the pass is done.
+ *	    4. The thread hashes them.
+ *	    5. HYPERCALL_SA_DEDUP (lookup): the first frame of k->sa_frames
+ *	       with the same hash as each is pinned the same way.
+ *	    6. The thread compares each with what was pinned for it, or else
+ *	       with the ones before it of this pass, and picks what it's to
+ *	       be merged into.
+ *	    7. HYPERCALL_SA_DEDUP (merge): pages still on their own frame are
+ *	       pointed at what was picked, frames still used are added to
+ *	       k->sa_frames for the next passes, and the references of the
+ *	       pass are dropped.
+ *	Root mode only ever moves pointers around: the 4 KB reads are done by
+ *	the thread, on frames that can't change under it.
+ *	The next write to a merged page splits it again (see get_cow_page()),
+ *	which is just taking the frame back when no one else shares it.
+ *
+ *	The table is only touched in root mode under frame_lock, except
+ *	dropping a reference, which is atomic: frames left with none stay in
+ *	the table (lookups skip them) until a merge pass unhashes them, and
+ *	their page is freed by the pass after, once a DPC made sure nobody
+ *	can still be reading it.
+ *
+ * Note #12:
+ *	A task is really a group of processes (struct sa_member, each with
+ *	its PID and PGD), that share its view, its COW pages and everything
+ *	else, so they see each other's writes, and everything done to a task
+ *	(snapshot, reset, limits, ...) is done to all of them at once, given
+ *	the PID of any.  ksm_sandbox() makes a new group of one,
+ *	ksm_sandbox_group() adds a process to an existing one, and with
+ *	KSM_SANDBOX_FOLLOW_FORK, every process forked off a member joins it
+ *	(from the sched_process_fork probe, or the process creation callback
+ *	on Windows) before it gets to run.  Threads need nothing, they're
+ *	found by the PGD they share.
+ *
+ *	ksm_unbox() removes one member, its process may be running on the
+ *	view meanwhile: HYPERCALL_SA_TASK takes a CPU off the view unless
+ *	what runs there is still a member, and its faults (the lookup fails
+ *	for them) just go back to the default view.  The group is freed with
+ *	its last member, or at once by ksm_unbox_group(), with one DPC either
+ *	way.
+ *
+ * Note #13:
+ *	Processes that exit are seen by a sched_process_exit probe (only the
+ *	last thread of a process counts), or the process creation callback on
+ *	Windows, which unbox them right there, just like ksm_unbox(): before
+ *	their PGD can be reused and mistaken for a boxed one, and with the
+ *	group freed if it was the last one.  That's the only place exits are
+ *	handled: nothing polls for dead tasks, and root mode, which can't
+ *	free anything, just goes back to the default view when a fault comes
+ *	from a process it can't find.
+ *
+ *	On Linux, the probe runs with preemption disabled, so it only unlinks
+ *	the member (or the group, with its last one) under task_lock, which
+ *	is what keeps the PGD from being found, and queues it on k->sa_dead
+ *	(or k->sa_dead_members) with the reference it got that way.  The
+ *	sandbox thread is woken to run the DPC and free it, see
+ *	sandbox_reap().  This also means the probe issues no hypercall, so it
+ *	doesn't care whether the CPU is subverted.
+ *
+ *	Boxed tasks don't outlive the vCPUs: ksm_unsubvert() unboxes them all
+ *	first, and on unload the thread and the probes are stopped before
+ *	that, see ksm_free().  Anyone who still held a task then (e.g. a fork
+ *	that was joining its group) may run its DPCs on CPUs that are already
+ *	devirtualized, which skip them, see sa_vmcall().
+ *
+ * Note #14:
+ *	Views are built read-execute (EPT_ACCESS_RX) except for pages mapped
+ *	in the kernel, see uniform_access(), which on Windows leaves the
+ *	process pages write-protected.  On Linux though, the direct map
+ *	covers all of RAM, so the view has nothing write-protected, and no
+ *	write would ever be copied.  There, the pages a process maps writable
+ *	(present, not huge) are write-protected in its task's view instead,
+ *	when it's boxed or added to a group (processes that follow a fork
+ *	share them with their parent until the kernel's own COW gives them
+ *	a new one), with ksm_set_ar_range(), so one hypercall per
+ *	SA_PROTECT_OPS runs of pages.  Pages the process maps writable
+ *	later are not protected: its writes to those go straight through,
+ *	and reset doesn't put them back.  A protected page the process frees
+ *	stays protected in its view, like any other page that changed hands
+ *	since the view was built on Windows.
  */
 struct cow_page {
 	u64 gpa;
 	u64 hpa;
 	void *hva;
-	struct list_head link;
+	u32 gen;			/* task snapshot it was made in  */
+	u32 freed_gen;			/* EPT generation it was unmapped at  */
+	u32 wp_gen;			/* ... made read-only at, see Note #10  */
+	bool scanned;			/* since it was last written, see Note #11  */
+	bool dropped;			/* reverted, on its way to be freed  */
+	struct cow_frame *shared;	/* frame it's merged into  */
+	struct cow_page *frozen;	/* copy it replaces, see Note #8  */
+	struct list_head lru;		/* see Note #10  */
+	struct list_head dedup;		/* task->dedup  */
 };
 
-struct sa_task {
+struct cow_frame {
+	void *hva;
+	u64 hpa;
+	u64 hash;
+	volatile u32 refs;
+	struct cow_frame *next;		/* hash chain, then k->sa_orphans  */
+	struct cow_frame *match;	/* to merge into, see Note #11  */
+	bool pending;			/* collected by the running pass  */
+};
+
+#define COW_LEVELS		4
+#define COW_SHIFT		9
+#define COW_FANOUT		(1 << COW_SHIFT)
+
+#define SA_FA_DEFAULT		8
+#define SA_FA_MAX		32
+
+#define SA_RECLAIM_SCAN		64
+
+#define SA_DEDUP_SCAN		128
+#define SA_DEDUP_MS		1000
+#define SA_DEDUP_PROTECT	0
+#define SA_DEDUP_COLLECT	1
+#define SA_DEDUP_LOOKUP		2
+#define SA_DEDUP_MERGE		3
+
+#define SA_PROTECT_OPS		64
+
+/*
+ * A boxed process, see Note #12.  Processes of a group are members of the
+ * same task.
+ */
+struct sa_member {
 	pid_t pid;
 	u64 pgd;
-	u16 eptp[KSM_MAX_VCPUS];
-	struct list_head pages;
-	struct list_head link;
+	struct sa_task *task;
+	struct sa_member *volatile pgd_next;
+	struct sa_member *volatile pid_next;
+	struct list_head link;		/* task->members, writers only  */
+};
+
+struct sa_task {
+	u16 eptp;			/* see Note #7  */
+	volatile u32 refs;		/* see Note #5  */
+	u32 flags;			/* KSM_SANDBOX_FOLLOW_FORK  */
+	struct list_head members;	/* writers only  */
+	void *volatile cow_root;	/* see Note #6  */
+	u32 snap_gen;			/* see Note #8  */
+	spinlock_t cow_lock;		/* lru and limbo, root mode only  */
+	struct list_head lru;		/* see Note #10  */
+	struct list_head limbo;
+	struct list_head dedup;		/* see Note #11  */
+	volatile u32 nr_pages;
+	u32 peak_pages;
+	u32 max_pages;			/* 0: no limit  */
+	u32 policy;			/* KSM_SANDBOX_*  */
+	u32 fa_max;			/* See Note #9  */
+	volatile u32 fa_hits;
+	volatile u32 fa_misses;
+	volatile u32 fa_pages;
+	struct list_head link;		/* k->task_list, writers only  */
+};
+
+/* HYPERCALL_SA_RESET argument  */
+struct sa_reset {
+	struct sa_task *task;
+	struct list_head freed;
+};
+
+/* HYPERCALL_SA_DEDUP argument, see Note #11  */
+struct sa_dedup {
+	u32 phase;
+	u32 nr;
+	struct cow_frame *cand[SA_DEDUP_SCAN];	/* collected  */
+	struct cow_frame *pin[SA_DEDUP_SCAN];	/* looked up for each  */
 };
 
+static DEFINE_OBJ_CACHE(cow_cache, struct cow_page);
+static DEFINE_OBJ_CACHE(frame_cache, struct cow_frame);
+static DEFINE_OBJ_CACHE(task_cache, struct sa_task);
+static DEFINE_OBJ_CACHE(member_cache, struct sa_member);
+
+static inline size_t sa_hash(u64 key)
+{
+	return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - SA_HASH_BITS));
+}
+
+static inline struct sa_member *volatile *pgd_bucket(struct ksm *k, u64 pgd)
+{
+	return &k->task_pgd[sa_hash(pgd >> PAGE_SHIFT)];
+}
+
+static inline struct sa_member *volatile *pid_bucket(struct ksm *k, pid_t pid)
+{
+	return &k->task_pid[sa_hash((uintptr_t)pid)];
+}
+
+/* Lock-free, see Note #5.  */
+static struct sa_member *find_sa_member_pgd(struct ksm *k, u64 pgd)
+{
+	struct sa_member *m;
+
+	for (m = *pgd_bucket(k, pgd); m; m = m->pgd_next)
+		if (m->pgd == pgd)
+			return m;
+
+	return NULL;
+}
+
+static struct sa_member *find_sa_member_pid(struct ksm *k, pid_t pid)
+{
+	struct sa_member *m;
+
+	for (m = *pid_bucket(k, pid); m; m = m->pid_next)
+		if (m->pid == pid)
+			return m;
+
+	return NULL;
+}
+
+static struct sa_task *find_sa_task_pgd(struct ksm *k, u64 pgd)
+{
+	struct sa_member *m = find_sa_member_pgd(k, pgd);
+	return m ? m->task : NULL;
+}
+
+static struct sa_task *find_sa_task_pid(struct ksm *k, pid_t pid)
+{
+	struct sa_member *m = find_sa_member_pid(k, pid);
+	return m ? m->task : NULL;
+}
+
+static struct sa_task *find_sa_task_pgd_pid(struct ksm *k, pid_t pid, u64 pgd)
+{
+	struct sa_task *task = find_sa_task_pgd(k, pgd);
+	if (task)
+		return task;
+
+	return find_sa_task_pid(k, pid);
+}
+
+/* Writers only, with task_lock held.  */
+static void link_sa_member(struct ksm *k, struct sa_member *m)
+{
+	struct sa_member *volatile *pgd = pgd_bucket(k, m->pgd);
+	struct sa_member *volatile *pid = pid_bucket(k, m->pid);
+
+	m->pgd_next = *pgd;
+	m->pid_next = *pid;
+	barrier();
+	*pgd = m;
+	*pid = m;
+	list_add(&m->link, &m->task->members);
+}
+
+static void unhash_sa_member(struct ksm *k, struct sa_member *m)
+{
+	struct sa_member *volatile *pp;
+
+	for (pp = pgd_bucket(k, m->pgd); *pp != m; pp = &(*pp)->pgd_next)
+		;
+	*pp = m->pgd_next;
+
+	for (pp = pid_bucket(k, m->pid); *pp != m; pp = &(*pp)->pid_next)
+		;
+	*pp = m->pid_next;
+}
+
+static void unlink_sa_member(struct ksm *k, struct sa_member *m)
+{
+	unhash_sa_member(k, m);
+	list_del(&m->link);
+}
+
+static void link_sa_task(struct ksm *k, struct sa_task *task,
+			 struct sa_member *m)
+{
+	m->task = task;
+	link_sa_member(k, m);
+	list_add(&task->link, &k->task_list);
+}
+
+/* Its members stay on task->members, to be freed with it.  */
+static void unlink_sa_task(struct ksm *k, struct sa_task *task)
+{
+	struct sa_member *m = NULL;
+
+	list_for_each_entry(m, &task->members, link)
+		unhash_sa_member(k, m);
+
+	list_del(&task->link);
+}
+
 static inline u16 task_eptp(struct sa_task *task)
 {
-	return task->eptp[cpu_nr()];
+	return task->eptp;
+}
+
+static inline unsigned int cow_index(u64 gfn, int level)
+{
+	return (gfn >> (level * COW_SHIFT)) & (COW_FANOUT - 1);
+}
+
+/*
+ * Return the slot of @gfn in @task's COW tree, allocating the nodes on the
+ * way, root mode only.
+ */
+static void *volatile *cow_slot(struct vcpu *vcpu, struct sa_task *task, u64 gfn)
+{
+	void *volatile *slot = &task->cow_root;
+	void *node;
+	int level;
+
+	for (level = COW_LEVELS - 1; level >= 0; --level) {
+		node = *slot;
+		if (!node) {
+			node = vcpu_alloc_page(vcpu);
+			if (!node)
+				return NULL;
+
+			if (!__cas64((volatile u64 *)slot, 0, (u64)node)) {
+				vcpu_free_page(vcpu, node);
+				node = *slot;
+			}
+		}
+
+		slot = (void *volatile *)node + cow_index(gfn, level);
+	}
+
+	return slot;
+}
+
+/* The frame stays in k->sa_frames, see Note #11.  */
+static inline void put_cow_frame(struct cow_frame *frame)
+{
+	__xadd(&frame->refs, -1);
 }
 
 static inline void free_cow_page(struct cow_page *page)
 {
-	list_del(&page->link);
-	mm_free_page(page->hva);
-	__mm_free_pool(page);
+	if (page->frozen)
+		free_cow_page(page->frozen);
+
+	if (page->shared)
+		put_cow_frame(page->shared);
+	else
+		mm_free_page(page->hva);
+	cache_free(&cow_cache, page);
+}
+
+/* Same as free_cow_page() without the frozen copy, root mode only.  */
+static inline void vcpu_free_cow_page(struct vcpu *vcpu, struct cow_page *page)
+{
+	if (page->shared)
+		put_cow_frame(page->shared);
+	else
+		vcpu_free_page(vcpu, page->hva);
+	cache_free(&cow_cache, page);
+}
+
+/*
+ * Account a new COW page to @task, unless that goes over a limit and
+ * @force is not set, see Note #10.
+ */
+static bool charge_cow_page(struct ksm *k, struct sa_task *task, bool force)
+{
+	u32 nr;
+
+	if (!force &&
+	    ((task->max_pages && task->nr_pages >= task->max_pages) ||
+	     (k->sa_max_pages && k->sa_pages >= k->sa_max_pages)))
+		return false;
+
+	nr = __xadd(&task->nr_pages, 1) + 1;
+	if (nr > task->peak_pages)
+		task->peak_pages = nr;
+
+	nr = __xadd(&k->sa_pages, 1) + 1;
+	if (nr > k->sa_peak_pages)
+		k->sa_peak_pages = nr;
+	return true;
+}
+
+static inline void uncharge_cow_pages(struct ksm *k, struct sa_task *task, u32 nr)
+{
+	__xadd(&task->nr_pages, -(s32)nr);
+	__xadd(&k->sa_pages, -(s32)nr);
+}
+
+/* Whether every vCPU synced past EPT generation @gen.  */
+static bool ept_gen_passed(struct ksm *k, u32 gen)
+{
+	struct vcpu *vcpu;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		vcpu = ksm_cpu_at(k, i);
+		if (vcpu->subverted && (s32)(*(volatile u32 *)&vcpu->ept_gen - gen) < 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* Free what's safe to free in @task's limbo, cow_lock held.  */
+static void drain_cow_limbo(struct vcpu *vcpu, struct sa_task *task)
+{
+	struct cow_page *page = NULL;
+	struct cow_page *next = NULL;
+	struct ksm *k = vcpu_to_ksm(vcpu);
+
+	list_for_each_entry_safe(page, next, &task->limbo, lru) {
+		if (!ept_gen_passed(k, page->freed_gen))
+			break;
+
+		list_del(&page->lru);
+		vcpu_free_cow_page(vcpu, page);
+	}
+}
+
+/*
+ * The frame @gpa was copied from when it has no frozen copy: views are made
+ * from the identity map (see ept_create_ptr()), and what the current one
+ * maps it to may well be the copy itself.
+ */
+static inline u64 cow_origin_hpa(u64 gpa)
+{
+	return PAGE_PA(gpa);
+}
+
+/* Whether @page still is what it was copied from.  */
+static bool cow_page_clean(struct vcpu *vcpu, struct cow_page *page)
+{
+	void *h;
+	bool ret;
+
+	if (page->frozen)
+		return memcmp(page->hva, page->frozen->hva, PAGE_SIZE) == 0;
+
+	h = vcpu_map_page(vcpu, cow_origin_hpa(page->gpa));
+	if (!h)
+		return false;
+
+	ret = memcmp(page->hva, h, PAGE_SIZE) == 0;
+	vcpu_unmap_page(vcpu, h);
+	return ret;
+}
+
+/*
+ * Put back the page @page was copied from in @task's view, and in its COW
+ * tree, cow_lock and the EPT lock held.  @page is left off any list.
+ */
+static bool revert_cow_page(struct vcpu *vcpu, struct sa_task *task,
+			    struct cow_page *page)
+{
+	struct ept *ept = vcpu_ept(vcpu);
+	void *volatile *slot;
+	u64 *epte;
+	u64 hpa;
+
+	slot = cow_slot(vcpu, task, page->gpa >> PAGE_SHIFT);
+	epte = ept_split_pte(ept, task->eptp, page->gpa);
+	if (!slot || !epte)
+		return false;
+
+	if (page->frozen)
+		hpa = page->frozen->hpa;
+	else
+		hpa = cow_origin_hpa(page->gpa);
+
+	list_del(&page->lru);
+	list_del_init(&page->dedup);
+	*slot = page->frozen;
+	if (page->frozen) {
+		page->frozen->wp_gen = ept->gen + 1;
+		list_add(&page->frozen->lru, &task->lru);
+	}
+
+	page->frozen = NULL;
+	page->dropped = true;
+	__set_epte_ar_pfn(epte, EPT_ACCESS_RX, hpa >> PAGE_SHIFT);
+	return true;
+}
+
+/*
+ * Whether @page can be compared and dropped: it must be what @task's view
+ * maps, read-only, and no CPU may still have a writable translation of it.
+ * If it's writable, it's made read-only here, to be looked at again once
+ * all CPUs synced, cow_lock and the EPT lock held.
+ */
+static bool cow_page_idle(struct vcpu *vcpu, struct sa_task *task,
+			  struct cow_page *page, bool *wp)
+{
+	struct ept *ept = vcpu_ept(vcpu);
+	u64 *epte;
+
+	epte = ept_split_pte(ept, task->eptp, page->gpa);
+	if (!epte || PAGE_PA(*epte) != page->hpa)
+		return false;
+
+	if (*epte & EPT_ACCESS_WRITE) {
+		__set_epte_ar(epte, EPT_ACCESS_RX);
+		page->wp_gen = ept->gen + 1;
+		*wp = true;
+		return false;
+	}
+
+	return ept_gen_passed(vcpu_to_ksm(vcpu), page->wp_gen);
+}
+
+/*
+ * Drop the oldest of @task's pages that are still clean, root mode only,
+ * see Note #10.  Returns how many were dropped.
+ */
+static u32 reclaim_cow_pages(struct vcpu *vcpu, struct sa_task *task)
+{
+	struct cow_page *page = NULL;
+	struct cow_page *next = NULL;
+	struct ept *ept = vcpu_ept(vcpu);
+	LIST_HEAD(freed);
+	u32 scanned = 0;
+	u32 nr = 0;
+	u32 gen;
+	bool wp = false;
+
+	spin_lock(&task->cow_lock);
+	drain_cow_limbo(vcpu, task);
+
+	ept_lock(ept);
+	list_for_each_entry_safe(page, next, &task->lru, lru) {
+		if (scanned++ == SA_RECLAIM_SCAN)
+			break;
+
+		if (!cow_page_idle(vcpu, task, page, &wp) ||
+		    !cow_page_clean(vcpu, page) ||
+		    !revert_cow_page(vcpu, task, page))
+			continue;
+
+		list_add_tail(&page->lru, &freed);
+		++nr;
+	}
+
+	if (nr || wp)
+		ept_flush(ept, task->eptp);
+	gen = ept->gen;
+	ept_unlock(ept);
+
+	list_for_each_entry_safe(page, next, &freed, lru) {
+		page->freed_gen = gen;
+		list_move_tail(&page->lru, &task->limbo);
+	}
+	spin_unlock(&task->cow_lock);
+
+	if (nr)
+		uncharge_cow_pages(vcpu_to_ksm(vcpu), task, nr);
+	return nr;
+}
+
+static void free_cow_tree(void **node, int level)
+{
+	int i;
+
+	for (i = 0; i < COW_FANOUT; ++i) {
+		if (!node[i])
+			continue;
+
+		if (level)
+			free_cow_tree(node[i], level - 1);
+		else
+			free_cow_page(node[i]);
+	}
+
+	__mm_free_page(node);
 }
 
+/*
+ * HYPERCALL_SA_TASK: leave @arg's view if this CPU is on it, when @arg is
+ * being freed, or one of its members was removed and isn't what's running
+ * here (see Note #12).
+ */
 bool ksm_sandbox_handle_vmcall(struct vcpu *vcpu, uintptr_t arg)
 {
 	struct sa_task *task = (struct sa_task *)arg;
-	u16 eptp = task_eptp(task);
-	if (vcpu_eptp_idx(vcpu) == eptp) {
+	struct ksm *k = vcpu_to_ksm(vcpu);
+	u64 cr3 = vmcs_read(GUEST_CR3) & PAGE_PA_MASK;
+
+	if (vcpu->fa_task == task)
+		vcpu->fa_task = NULL;
+
+	if (vcpu_eptp_idx(vcpu) == task_eptp(task) &&
+	    find_sa_task_pgd_pid(k, proc_id(), cr3) != task) {
 		if (vcpu->last_switch) {
 			vcpu_switch_root_eptp(vcpu, vcpu->eptp_before);
 			vcpu->last_switch = NULL;
@@ -95,308 +784,1871 @@ bool ksm_sandbox_handle_vmcall(struct vcpu *vcpu, uintptr_t arg)
 		}
 	}
 
-	if (eptp != EPT_MAX_EPTP_LIST)
-		ept_free_ptr(&vcpu->ept, eptp);
+	return true;
+}
+
+/*
+ * HYPERCALL_SA_FREE: free @arg's view, on one CPU only, once no CPU is on it
+ * anymore.
+ */
+bool ksm_sandbox_handle_free(struct vcpu *vcpu, uintptr_t arg)
+{
+	struct sa_task *task = (struct sa_task *)arg;
+
+	if (task->eptp != EPT_MAX_EPTP_LIST) {
+		ept_free_ptr(vcpu_ept(vcpu), task->eptp);
+		task->eptp = EPT_MAX_EPTP_LIST;
+	}
 
 	return true;
 }
 
-static DEFINE_DPC(__free_sa_task, __vmx_vmcall, HYPERCALL_SA_TASK, ctx);
-static inline void __free_sa_task(struct ksm *k, struct sa_task *task)
+static inline void clear_cr3_targets(struct vcpu *vcpu)
 {
-	struct cow_page *page = NULL;
-	struct cow_page *next = NULL;
+	if (vcpu->nr_cr3_targets) {
+		vmcs_write32(CR3_TARGET_COUNT, 0);
+		vcpu->nr_cr3_targets = 0;
+	}
 
-	list_for_each_entry_safe(page, next, &task->pages, link)
-		free_cow_page(page);
+	vcpu->next_cr3_target = 0;
+}
+
+/*
+ * Let loads of @cr3 go through without exiting, replacing the oldest value
+ * when the list is full.
+ */
+static inline void add_cr3_target(struct vcpu *vcpu, u64 cr3)
+{
+	u8 i = vcpu->next_cr3_target;
+	if (!vcpu->max_cr3_targets)
+		return;
+
+	vmcs_write(CR3_TARGET_VALUE0 + i * 2, cr3);
+	vcpu->next_cr3_target = (i + 1) % vcpu->max_cr3_targets;
+	if (vcpu->nr_cr3_targets < vcpu->max_cr3_targets)
+		vmcs_write32(CR3_TARGET_COUNT, ++vcpu->nr_cr3_targets);
+}
+
+static inline void set_cr3_exiting(struct vcpu *vcpu, bool on)
+{
+	u32 ctl = vcpu->cpu_ctl;
+	if (on)
+		ctl |= CPU_BASED_CR3_LOAD_EXITING;
+	else if (!vcpu->cr3_exit_fixed)
+		ctl &= ~CPU_BASED_CR3_LOAD_EXITING;
+
+	if (ctl != vcpu->cpu_ctl) {
+		vcpu->cpu_ctl = ctl;
+		vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, ctl);
+	}
+}
+
+/*
+ * Called from vcpu_run() with the primary processor controls, @msr is the
+ * capability MSR they were adjusted against.
+ */
+u32 ksm_sandbox_cpu_ctl(struct vcpu *vcpu, u32 ctl, u32 msr)
+{
+	u32 max = (__readmsr(MSR_IA32_VMX_MISC) >> 16) & 0x1FF;
+
+	vcpu->max_cr3_targets = max > 4 ? 4 : max;
+	vcpu->nr_cr3_targets = 0;
+	vcpu->next_cr3_target = 0;
+	vcpu->cr3_exit_fixed = !!((u32)__readmsr(msr) & CPU_BASED_CR3_LOAD_EXITING);
+	if (vcpu->cr3_exit_fixed)
+		return ctl;
+
+#ifndef SANDBOX_VMFUNC
+	if (!list_empty(&vcpu_to_ksm(vcpu)->task_list))
+		return ctl;
+#endif
+	return ctl & ~CPU_BASED_CR3_LOAD_EXITING;
+}
+
+/*
+ * HYPERCALL_SA_SNAP: freeze the pages @arg wrote since its last snapshot,
+ * see Note #8.  Other CPUs must invalidate afterwards.
+ */
+bool ksm_sandbox_handle_snap(struct vcpu *vcpu, uintptr_t arg)
+{
+	struct sa_task *task = (struct sa_task *)arg;
+	struct ept *ept = vcpu_ept(vcpu);
+	struct cow_page *page = NULL;
+	u32 nr = 0;
+	u64 *epte;
+
+	spin_lock(&task->cow_lock);
+	ept_lock(ept);
+	list_for_each_entry_reverse(page, &task->lru, lru) {
+		if (page->gen != task->snap_gen)
+			break;
+
+		epte = ept_split_pte(ept, task->eptp, page->gpa);
+		if (epte)
+			__set_epte_ar(epte, EPT_ACCESS_RX);
+
+		/* Nothing maps the previous snapshot's copy.  */
+		if (page->frozen) {
+			vcpu_free_cow_page(vcpu, page->frozen);
+			page->frozen = NULL;
+			++nr;
+		}
+	}
+
+	++task->snap_gen;
+	ept_flush(ept, task->eptp);
+	ept_unlock(ept);
+	spin_unlock(&task->cow_lock);
+
+	uncharge_cow_pages(vcpu_to_ksm(vcpu), task, nr);
+	return true;
+}
+
+/*
+ * HYPERCALL_SA_RESET: put back what @arg's pages were at its last snapshot,
+ * see Note #8.  The discarded copies are returned in @arg->freed, they may
+ * only be freed after other CPUs invalidated.
+ */
+bool ksm_sandbox_handle_reset(struct vcpu *vcpu, uintptr_t arg)
+{
+	struct sa_reset *r = (struct sa_reset *)arg;
+	struct sa_task *task = r->task;
+	struct ept *ept = vcpu_ept(vcpu);
+	struct cow_page *page = NULL;
+	struct cow_page *prev = NULL;
+	u32 nr = 0;
+	bool ret = true;
+
+	spin_lock(&task->cow_lock);
+	ept_lock(ept);
+	list_for_each_entry_safe_reverse(page, prev, &task->lru, lru) {
+		if (page->gen != task->snap_gen)
+			break;
+
+		if (!revert_cow_page(vcpu, task, page)) {
+			ret = false;
+			break;
+		}
+
+		list_add_tail(&page->lru, &r->freed);
+		++nr;
+	}
+
+	ept_flush(ept, task->eptp);
+	ept_unlock(ept);
+	spin_unlock(&task->cow_lock);
+
+	uncharge_cow_pages(vcpu_to_ksm(vcpu), task, nr);
+	return ret;
+}
+
+static inline struct cow_frame **frame_bucket(struct ksm *k, u64 hash)
+{
+	return &k->sa_frames[hash >> (64 - SA_DEDUP_BITS)];
+}
+
+static u64 hash_cow_frame(const void *hva)
+{
+	const u64 *p = hva;
+	u64 h = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); ++i)
+		h = (h ^ p[i]) * 0x100000001B3ULL;
+
+	return h * 0x9E3779B97F4A7C15ULL;
+}
+
+/* frame_lock held.  */
+static void unhash_cow_frame(struct ksm *k, struct cow_frame *frame)
+{
+	struct cow_frame **pp;
+
+	for (pp = frame_bucket(k, frame->hash); *pp; pp = &(*pp)->next) {
+		if (*pp == frame) {
+			*pp = frame->next;
+			--k->sa_nr_frames;
+			break;
+		}
+	}
+}
+
+static void push_cow_orphan(struct ksm *k, struct cow_frame *frame)
+{
+	struct cow_frame *head;
+
+	do {
+		head = k->sa_orphans;
+		frame->next = head;
+		barrier();
+	} while (!__cas64((volatile u64 *)&k->sa_orphans, (u64)head, (u64)frame));
+}
+
+/* Move frames no one uses anymore to k->sa_orphans, frame_lock held.  */
+static void collect_cow_frames(struct ksm *k)
+{
+	struct cow_frame **pp;
+	struct cow_frame *frame;
+	int i;
+
+	for (i = 0; i < SA_DEDUP_SIZE; ++i) {
+		pp = &k->sa_frames[i];
+		while ((frame = *pp)) {
+			if (frame->refs) {
+				pp = &frame->next;
+				continue;
+			}
+
+			*pp = frame->next;
+			--k->sa_nr_frames;
+			push_cow_orphan(k, frame);
+		}
+	}
+}
+
+/* Queue pages of @task to be merged, cow_lock and the EPT lock held.  */
+static u32 dedup_protect(struct ept *ept, struct sa_task *task, u32 budget)
+{
+	struct cow_page *page = NULL;
+	u32 nr = 0;
+	u64 *epte;
+
+	list_for_each_entry(page, &task->lru, lru) {
+		if (nr == budget)
+			break;
+
+		if (page->scanned || page->shared)
+			continue;
+
+		epte = ept_split_pte(ept, task->eptp, page->gpa);
+		if (!epte)
+			continue;
+
+		__set_epte_ar(epte, EPT_ACCESS_RX);
+		page->wp_gen = ept->gen + 1;
+		page->scanned = true;
+		list_add_tail(&page->dedup, &task->dedup);
+		++nr;
+	}
+
+	if (nr)
+		ept_flush(ept, task->eptp);
+	return nr;
+}
+
+/*
+ * Give the queued pages of @task that weren't written to since they were
+ * protected a frame of their own, and add it to @d, cow_lock, frame_lock and
+ * the EPT lock held.
+ */
+static void dedup_collect(struct ept *ept, struct sa_task *task,
+			  struct sa_dedup *d)
+{
+	struct cow_page *page = NULL;
+	struct cow_frame *own;
+	u64 *epte;
+
+	list_for_each_entry(page, &task->dedup, dedup) {
+		if (d->nr == SA_DEDUP_SCAN)
+			break;
+
+		if (!page->scanned || page->shared)
+			continue;
+
+		epte = ept_split_pte(ept, task->eptp, page->gpa);
+		if (!epte || (*epte & EPT_ACCESS_WRITE) ||
+		    PAGE_PA(*epte) != page->hpa)
+			continue;
+
+		own = cache_alloc(&frame_cache);
+		if (!own)
+			break;
+
+		/* @page's reference, and the pass'.  */
+		own->hva = page->hva;
+		own->hpa = page->hpa;
+		own->refs = 2;
+		own->pending = true;
+		page->shared = own;
+		d->cand[d->nr++] = own;
+	}
+}
+
+/* Pin a frame of the table for each frame of @d, frame_lock held.  */
+static void dedup_lookup(struct ksm *k, struct sa_dedup *d)
+{
+	struct cow_frame *frame;
+	u32 i;
+
+	for (i = 0; i < d->nr; ++i) {
+		d->pin[i] = NULL;
+		for (frame = *frame_bucket(k, d->cand[i]->hash); frame; frame = frame->next) {
+			if (frame->refs && frame->hash == d->cand[i]->hash) {
+				__xadd(&frame->refs, 1);
+				d->pin[i] = frame;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Point the queued pages of @task that are still on the frame collected for
+ * them at the one it matched, cow_lock, frame_lock and the EPT lock held.
+ */
+static void dedup_merge(struct ksm *k, struct ept *ept, struct sa_task *task)
+{
+	struct cow_page *page = NULL;
+	struct cow_page *next = NULL;
+	struct cow_frame *frame;
+	struct cow_frame *own;
+	bool changed = false;
+	u64 *epte;
+
+	list_for_each_entry_safe(page, next, &task->dedup, dedup) {
+		list_del_init(&page->dedup);
+		own = page->shared;
+		if (!own || !own->pending || !own->match)
+			continue;
+
+		epte = ept_split_pte(ept, task->eptp, page->gpa);
+		if (!epte || PAGE_PA(*epte) != own->hpa)
+			continue;
+
+		frame = own->match;
+		__xadd(&frame->refs, 1);
+		put_cow_frame(own);
+		page->shared = frame;
+		page->hva = frame->hva;
+		page->hpa = frame->hpa;
+		__set_epte_ar_pfn(epte, EPT_ACCESS_RX, frame->hpa >> PAGE_SHIFT);
+		__xadd(&k->sa_merged, 1);
+		changed = true;
+	}
+
+	if (changed)
+		ept_flush(ept, task->eptp);
+}
+
+/*
+ * Drop the references of the pass: frames that are still used go to the
+ * table, the others are freed with the next pass, frame_lock held.
+ */
+static void dedup_release(struct ksm *k, struct sa_dedup *d)
+{
+	struct cow_frame *own;
+	u32 i;
+
+	for (i = 0; i < d->nr; ++i) {
+		own = d->cand[i];
+		own->pending = false;
+		if (own->refs > 1) {
+			own->next = *frame_bucket(k, own->hash);
+			*frame_bucket(k, own->hash) = own;
+			++k->sa_nr_frames;
+			put_cow_frame(own);
+		} else {
+			/* Only ours, nobody can take one anymore.  */
+			own->refs = 0;
+			push_cow_orphan(k, own);
+		}
+
+		if (d->pin[i])
+			put_cow_frame(d->pin[i]);
+	}
+}
+
+/*
+ * HYPERCALL_SA_DEDUP: one phase of a merge pass over all tasks, see
+ * Note #11.  The caller holds task_lock.
+ */
+bool ksm_sandbox_handle_dedup(struct vcpu *vcpu, uintptr_t arg)
+{
+	struct sa_dedup *d = (struct sa_dedup *)arg;
+	struct ksm *k = vcpu_to_ksm(vcpu);
+	struct ept *ept = vcpu_ept(vcpu);
+	struct sa_task *task = NULL;
+	u32 budget = SA_DEDUP_SCAN;
+
+	if (d->phase == SA_DEDUP_LOOKUP) {
+		spin_lock(&k->frame_lock);
+		dedup_lookup(k, d);
+		spin_unlock(&k->frame_lock);
+		return true;
+	}
+
+	if (d->phase == SA_DEDUP_MERGE) {
+		spin_lock(&k->frame_lock);
+		collect_cow_frames(k);
+		spin_unlock(&k->frame_lock);
+	}
+
+	list_for_each_entry(task, &k->task_list, link) {
+		spin_lock(&task->cow_lock);
+		if (d->phase != SA_DEDUP_PROTECT)
+			spin_lock(&k->frame_lock);
+		ept_lock(ept);
+
+		if (d->phase == SA_DEDUP_PROTECT)
+			budget -= dedup_protect(ept, task, budget);
+		else if (d->phase == SA_DEDUP_COLLECT)
+			dedup_collect(ept, task, d);
+		else
+			dedup_merge(k, ept, task);
+
+		ept_unlock(ept);
+		if (d->phase != SA_DEDUP_PROTECT)
+			spin_unlock(&k->frame_lock);
+		spin_unlock(&task->cow_lock);
+
+		if (!budget)
+			break;
+	}
+
+	if (d->phase == SA_DEDUP_MERGE) {
+		spin_lock(&k->frame_lock);
+		dedup_release(k, d);
+		spin_unlock(&k->frame_lock);
+	}
+
+	return true;
+}
+
+/*
+ * HYPERCALL_SA_NEW: a task is being boxed, create its view if that wasn't
+ * done yet (i.e. the first call, made before the task is published), and
+ * start watching CR3 loads, its CR3 may well be one of the targets.
+ */
+bool ksm_sandbox_handle_new(struct vcpu *vcpu, uintptr_t arg)
+{
+	struct sa_task *task = (struct sa_task *)arg;
+
+	if (task->eptp == EPT_MAX_EPTP_LIST) {
+		if (!ept_create_ptr(vcpu_ept(vcpu), EPT_ACCESS_RX, &task->eptp))
+			return false;
+	}
+
+#ifndef SANDBOX_VMFUNC
+	clear_cr3_targets(vcpu);
+	set_cr3_exiting(vcpu, true);
+#endif
+	return true;
+}
+
+/*
+ * A CPU that isn't subverted (anymore) is on no view, so there's nothing for
+ * it to do: this lets whoever still held a task when ksm_sandbox_unbox_all()
+ * ran finish with it after the CPUs are devirtualized.  Interrupts (DPCs)
+ * must be disabled, so that it can't be devirtualized in between.
+ */
+static u8 sa_vmcall(uintptr_t hc, void *d)
+{
+	if (!ksm_current_cpu()->subverted)
+		return 0;
+
+	return __vmx_vmcall(hc, d);
+}
+
+static DEFINE_DPC(__new_sa_task, sa_vmcall, HYPERCALL_SA_NEW, ctx);
+static DEFINE_DPC(__free_sa_task, sa_vmcall, HYPERCALL_SA_TASK, ctx);
+static DEFINE_DPC(__sa_invept, sa_vmcall, HYPERCALL_INVEPT, ctx);
+static inline void release_sa_task(struct ksm *k, struct sa_task *task)
+{
+	struct cow_page *page = NULL;
+	struct cow_page *next = NULL;
+	struct sa_member *m = NULL;
+	struct sa_member *n = NULL;
+
+	if (task->cow_root)
+		free_cow_tree(task->cow_root, COW_LEVELS - 1);
+
+	list_for_each_entry_safe(page, next, &task->limbo, lru)
+		free_cow_page(page);
+
+	list_for_each_entry_safe(m, n, &task->members, link)
+		cache_free(&member_cache, m);
+
+	uncharge_cow_pages(k, task, task->nr_pages);
+	cache_free(&task_cache, task);
+}
+
+/*
+ * @task must have been unlinked already, the DPC takes every CPU off its view
+ * and is what makes it safe to free, see Note #5.
+ */
+static inline void free_sa_task(struct ksm *k, struct sa_task *task)
+{
+	unsigned long flags;
+
+	CALL_DPC(__free_sa_task, task);
+	spin_lock_irqsave(&k->task_lock, flags);
+	sa_vmcall(HYPERCALL_SA_FREE, task);
+	spin_unlock_irqrestore(&k->task_lock, flags);
+	release_sa_task(k, task);
+}
+
+/* task_lock held.  */
+static inline void get_sa_task(struct sa_task *task)
+{
+	__xadd(&task->refs, 1);
+}
+
+/* The last reference frees @task, which must be unlinked by then.  */
+static inline void put_sa_task(struct ksm *k, struct sa_task *task)
+{
+	if (__xadd(&task->refs, -1) == 1)
+		free_sa_task(k, task);
+}
+
+/*
+ * task_lock held.  Take @pid out of its group, or unlink the whole group if
+ * it's the last member, @last tells which.  Either way, the caller holds a
+ * reference to the task for the rest, see finish_unbox().
+ */
+static struct sa_member *unlink_sa_pid(struct ksm *k, pid_t pid, bool *last)
+{
+	struct sa_member *m;
+	struct sa_task *task;
+
+	m = find_sa_member_pid(k, pid);
+	if (!m)
+		return NULL;
+
+	task = m->task;
+	*last = list_is_singular(&task->members);
+	if (*last) {
+		/* task_list's reference is ours now.  */
+		unlink_sa_task(k, task);
+	} else {
+		unlink_sa_member(k, m);
+		get_sa_task(task);
+	}
+
+	return m;
+}
+
+/* The rest of unlink_sa_pid(), with task_lock dropped.  */
+static void finish_unbox(struct ksm *k, struct sa_member *m, bool last)
+{
+	struct sa_task *task = m->task;
+
+	if (!last) {
+		/* Gets it off the view if it's running, see Note #12.  */
+		CALL_DPC(__free_sa_task, task);
+		cache_free(&member_cache, m);
+	}
+
+	put_sa_task(k, task);
+}
+
+/*
+ * Finish with what exit probes unlinked, see Note #13.  A group that was
+ * unlinked with its last member is queued by its task, the member is freed
+ * with it.
+ */
+static void sandbox_reap(struct ksm *k)
+{
+	struct sa_member *m = NULL;
+	struct sa_member *n = NULL;
+	struct sa_task *task = NULL;
+	struct sa_task *next = NULL;
+	LIST_HEAD(members);
+	LIST_HEAD(tasks);
+
+	spin_lock(&k->task_lock);
+	list_splice_init(&k->sa_dead_members, &members);
+	list_splice_init(&k->sa_dead, &tasks);
+	spin_unlock(&k->task_lock);
+
+	list_for_each_entry_safe(m, n, &members, link)
+		finish_unbox(k, m, false);
+
+	list_for_each_entry_safe(task, next, &tasks, link)
+		put_sa_task(k, task);
+}
+
+#ifdef __linux__
+static int find_process(pid_t pid, struct task_struct **tsk)
+{
+	struct pid *tsk_pid = find_vpid(pid);
+
+	if (!tsk_pid)
+		return -EINVAL;
+
+	*tsk = pid_task(tsk_pid, PIDTYPE_PID);
+	if (!*tsk)
+		return -ENOENT;
+
+	return 0;
+}
+#endif
+
+static int get_process_pgd(pid_t pid, u64 *pgd)
+{
+#ifdef __linux__
+	struct task_struct *tsk;
+	int ret;
+
+	ret = find_process(pid, &tsk);
+	if (ret < 0)
+		return ret;
+
+	/* Kernel threads, or it's exiting.  */
+	if (!tsk->mm)
+		return ERR_NOTH;
+
+	*pgd = __pa(tsk->mm->pgd) & PAGE_PA_MASK;
+	return 0;
+#else
+	NTSTATUS status;
+	PEPROCESS process;
+	KAPC_STATE apc;
+
+	status = PsLookupProcessByProcessId(pid, &process);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	KeStackAttachProcess(process, &apc);
+	*pgd = __readcr3() & PAGE_PA_MASK;
+	KeUnstackDetachProcess(&apc);
+	ObfDereferenceObject(process);
+	return 0;
+#endif
+}
+
+#ifdef __linux__
+/* See protect_user_pages()  */
+struct sa_protect {
+	struct ept_ar_op *ops;
+	int nr;
+	u16 eptp;
+};
+
+static int protect_flush(struct sa_protect *p)
+{
+	int ret = 0;
+
+	if (p->nr)
+		ret = ksm_set_ar_range(p->ops, p->nr);
+
+	p->nr = 0;
+	return ret;
+}
+
+/* Queue @pa, merged with the previous page if it's right after it.  */
+static int protect_page(struct sa_protect *p, u64 pa)
+{
+	struct ept_ar_op *op;
+	int ret;
+
+	if (p->nr) {
+		op = &p->ops[p->nr - 1];
+		if (op->gpa + op->size == pa) {
+			op->size += PAGE_SIZE;
+			return 0;
+		}
+	}
+
+	if (p->nr == SA_PROTECT_OPS) {
+		ret = protect_flush(p);
+		if (ret < 0)
+			return ret;
+	}
+
+	op = &p->ops[p->nr++];
+	op->gpa = pa;
+	op->size = PAGE_SIZE;
+	op->eptp = p->eptp;
+	op->ar = EPT_ACCESS_RX;
+	return 0;
+}
+
+/*
+ * Walk the user half of @mm, mmap lock held, skipping whatever isn't there
+ * a whole table at a time.  Huge pages are left alone.
+ */
+static int protect_mm(struct sa_protect *p, struct mm_struct *mm)
+{
+	unsigned long va = 0;
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	int ret;
+
+	while (va < TASK_SIZE) {
+		pgd = pgd_offset(mm, va);
+		if (pgd_none(*pgd) || pgd_bad(*pgd)) {
+			va = (va + PGDIR_SIZE) & PGDIR_MASK;
+			continue;
+		}
+
+		p4d = p4d_offset(pgd, va);
+		if (p4d_none(*p4d) || p4d_bad(*p4d)) {
+			va = (va + P4D_SIZE) & P4D_MASK;
+			continue;
+		}
+
+		pud = pud_offset(p4d, va);
+		if (pud_none(*pud) || pud_bad(*pud)) {
+			va = (va + PUD_SIZE) & PUD_MASK;
+			continue;
+		}
+
+		pmd = pmd_offset(pud, va);
+		if (pmd_none(*pmd) || pmd_bad(*pmd)) {
+			va = (va + PMD_SIZE) & PMD_MASK;
+			continue;
+		}
+
+		pte = pte_offset_kernel(pmd, va);
+		if (pte_present(*pte) && pte_write(*pte)) {
+			ret = protect_page(p, (u64)pte_pfn(*pte) << PAGE_SHIFT);
+			if (ret < 0)
+				return ret;
+		}
+
+		va += PAGE_SIZE;
+	}
+
+	return protect_flush(p);
+}
+
+/*
+ * The RX view is no different from the default one on Linux, since all of
+ * RAM is mapped in the kernel (see mm_kernel_range()), so write-protect what
+ * @pid maps writable in @task's view instead, see Note #14.
+ */
+static int protect_user_pages(struct sa_task *task, pid_t pid)
+{
+	struct task_struct *tsk;
+	struct mm_struct *mm;
+	struct sa_protect p;
+	int ret;
+
+	ret = find_process(pid, &tsk);
+	if (ret < 0)
+		return ret;
+
+	mm = get_task_mm(tsk);
+	if (!mm)
+		return ERR_NOTH;
+
+	p.ops = mm_alloc_pool(SA_PROTECT_OPS * sizeof(*p.ops));
+	if (!p.ops) {
+		mmput(mm);
+		return ERR_NOMEM;
+	}
+
+	p.nr = 0;
+	p.eptp = task->eptp;
+	mmap_read_lock(mm);
+	ret = protect_mm(&p, mm);
+	mmap_read_unlock(mm);
+
+	mm_free_pool(p.ops, SA_PROTECT_OPS * sizeof(*p.ops));
+	mmput(mm);
+	return ret;
+}
+#else
+/* The RX view already leaves out kernel pages.  */
+static inline int protect_user_pages(struct sa_task *task, pid_t pid)
+{
+	return 0;
+}
+#endif
+
+/*
+ * @child was just forked off @parent, add it to @parent's group if that one
+ * follows forks, see Note #12.
+ */
+static void sandbox_follow_fork(struct ksm *k, pid_t parent, u64 parent_pgd,
+				pid_t child, u64 child_pgd)
+{
+	struct sa_task *task;
+	struct sa_member *m = NULL;
+
+	/* Not lock-free, this may be interrupted by the DPC that frees it.  */
+	spin_lock(&k->task_lock);
+	task = find_sa_task_pgd_pid(k, parent, parent_pgd);
+	if (task && task->flags & KSM_SANDBOX_FOLLOW_FORK) {
+		m = cache_alloc(&member_cache);
+		if (m) {
+			m->pid = child;
+			m->pgd = child_pgd;
+			m->task = task;
+			link_sa_member(k, m);
+			get_sa_task(task);
+		}
+	}
+	spin_unlock(&k->task_lock);
+
+	if (!m)
+		return;
+
+	KSM_DEBUG("%d joins the group of %d\n", child, parent);
+	CALL_DPC(__new_sa_task, task);
+	put_sa_task(k, task);
+}
+
+#ifdef __linux__
+#ifdef SANDBOX_VMFUNC
+/*
+ * Runs in the guest, with interrupts disabled, right before the switch to
+ * @next's address space.
+ */
+static void sandbox_sched_switch(void *data, bool preempt,
+				 struct task_struct *prev,
+				 struct task_struct *next
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+				 , unsigned int prev_state
+#endif
+				 )
+{
+	struct ksm *k = data;
+	struct sa_task *task;
+	u16 eptp = EPTP_DEFAULT;
+
+	if (list_empty(&k->task_list) || !ksm_current_cpu()->subverted)
+		return;
+
+	if (next->mm) {
+		task = find_sa_task_pgd(k, __pa(next->mm->pgd) & PAGE_PA_MASK);
+		if (task)
+			eptp = task_eptp(task);
+	}
+
+	vcpu_vmfunc(eptp, 0);
+}
+
+#endif
+
+/*
+ * Runs in the parent, with preemption disabled, before the child can run.
+ * Threads share the PGD they're already found by.
+ */
+static void sandbox_sched_fork(void *data, struct task_struct *parent,
+			       struct task_struct *child)
+{
+	struct ksm *k = data;
+
+	if (list_empty(&k->task_list) || !ksm_current_cpu()->subverted)
+		return;
+
+	if (!parent->mm || !child->mm || child->mm == parent->mm)
+		return;
+
+	sandbox_follow_fork(k, parent->pid, __pa(parent->mm->pgd) & PAGE_PA_MASK,
+			    child->pid, __pa(child->mm->pgd) & PAGE_PA_MASK);
+}
+
+static DECLARE_WAIT_QUEUE_HEAD(sandbox_wait);
+
+/*
+ * Runs in the exiting thread, with preemption disabled, after its mm is
+ * gone, so only the last thread of a process is looked up, by PID.  It only
+ * unlinks it, the rest is left to the sandbox thread, see Note #13.
+ */
+static void sandbox_sched_exit(void *data, struct task_struct *p)
+{
+	struct ksm *k = data;
+	struct sa_member *m;
+	bool last = false;
+
+	if (list_empty(&k->task_list) || atomic_read(&p->signal->live))
+		return;
+
+	spin_lock(&k->task_lock);
+	m = unlink_sa_pid(k, p->tgid, &last);
+	if (m && last)
+		list_add_tail(&m->task->link, &k->sa_dead);
+	else if (m)
+		list_add_tail(&m->link, &k->sa_dead_members);
+	spin_unlock(&k->task_lock);
+
+	if (m)
+		wake_up(&sandbox_wait);
+}
+
+static struct sa_probe {
+	const char *name;
+	void *probe;
+	struct tracepoint *tp;
+} sa_probes[] = {
+#ifdef SANDBOX_VMFUNC
+	{ "sched_switch", sandbox_sched_switch, NULL },
+#endif
+	{ "sched_process_fork", sandbox_sched_fork, NULL },
+	{ "sched_process_exit", sandbox_sched_exit, NULL },
+};
+
+static void find_sa_probes(struct tracepoint *tp, void *priv)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sa_probes); ++i)
+		if (!strcmp(tp->name, sa_probes[i].name))
+			sa_probes[i].tp = tp;
+}
+
+static inline void unregister_sched_hook(struct ksm *k)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sa_probes); ++i) {
+		if (sa_probes[i].tp) {
+			tracepoint_probe_unregister(sa_probes[i].tp, sa_probes[i].probe, k);
+			sa_probes[i].tp = NULL;
+		}
+	}
+
+	tracepoint_synchronize_unregister();
+}
+
+static inline int register_sched_hook(struct ksm *k)
+{
+	size_t i, j;
+	int ret = 0;
+
+	for_each_kernel_tracepoint(find_sa_probes, NULL);
+	for (i = 0; i < ARRAY_SIZE(sa_probes); ++i) {
+		if (!sa_probes[i].tp)
+			ret = -ENOENT;
+		else
+			ret = tracepoint_probe_register(sa_probes[i].tp, sa_probes[i].probe, k);
+
+		if (ret < 0)
+			break;
+	}
+
+	if (ret < 0) {
+		/* Only unregister those that were.  */
+		for (j = i; j < ARRAY_SIZE(sa_probes); ++j)
+			sa_probes[j].tp = NULL;
+
+		unregister_sched_hook(k);
+	}
+
+	return ret;
+}
+#else
+/*
+ * Runs at PASSIVE_LEVEL, in the context of the thread that created the
+ * process, which can't run yet, or of the last thread of an exiting one.
+ */
+static VOID sandbox_process_notify(HANDLE parent, HANDLE pid, BOOLEAN create)
+{
+	struct sa_task *task;
+	bool follow;
+	u64 pgd;
+
+	if (list_empty(&ksm->task_list))
+		return;
+
+	if (!create) {
+		ksm_unbox(ksm, pid);
+		return;
+	}
+
+	spin_lock(&ksm->task_lock);
+	task = find_sa_task_pid(ksm, parent);
+	follow = task && task->flags & KSM_SANDBOX_FOLLOW_FORK;
+	spin_unlock(&ksm->task_lock);
+
+	/* Only attach to it if it's going to be boxed.  */
+	if (follow && get_process_pgd(pid, &pgd) == 0)
+		sandbox_follow_fork(ksm, parent, 0, pid, pgd);
+}
+
+static inline int register_sched_hook(struct ksm *k)
+{
+	return PsSetCreateProcessNotifyRoutine(sandbox_process_notify, FALSE);
+}
+
+static inline void unregister_sched_hook(struct ksm *k)
+{
+	PsSetCreateProcessNotifyRoutine(sandbox_process_notify, TRUE);
+}
+#endif
+
+static void free_cow_orphans(struct cow_frame *frame)
+{
+	struct cow_frame *next;
+
+	for (; frame; frame = next) {
+		next = frame->next;
+		mm_free_page(frame->hva);
+		cache_free(&frame_cache, frame);
+	}
+}
+
+/*
+ * Pick what each frame of @d is to be merged into, if anything, see
+ * Note #11.  All of them are pinned, so none can change meanwhile.
+ */
+static void dedup_match(struct sa_dedup *d)
+{
+	struct cow_frame *own;
+	struct cow_frame *m;
+	u32 i;
+	u32 j;
+
+	for (i = 0; i < d->nr; ++i) {
+		own = d->cand[i];
+		own->match = NULL;
+		if (d->pin[i]) {
+			if (memcmp(d->pin[i]->hva, own->hva, PAGE_SIZE) == 0) {
+				own->match = d->pin[i];
+				continue;
+			}
+
+			put_cow_frame(d->pin[i]);
+			d->pin[i] = NULL;
+		}
+
+		for (j = 0; j < i; ++j) {
+			m = d->cand[j]->match ? d->cand[j]->match : d->cand[j];
+			if (d->cand[j]->hash == own->hash &&
+			    memcmp(m->hva, own->hva, PAGE_SIZE) == 0) {
+				own->match = m;
+				break;
+			}
+		}
+	}
+}
+
+static inline void dedup_phase(struct ksm *k, struct sa_dedup *d, u32 phase)
+{
+	unsigned long flags;
+
+	d->phase = phase;
+	spin_lock_irqsave(&k->task_lock, flags);
+	sa_vmcall(HYPERCALL_SA_DEDUP, d);
+	spin_unlock_irqrestore(&k->task_lock, flags);
+}
+
+/* Run a merge pass, from the dedup thread, see Note #11.  */
+static void sandbox_dedup(struct ksm *k)
+{
+	struct sa_dedup *d;
+	struct cow_frame *orphans;
+	u32 i;
+
+	if (list_empty(&k->task_list) || !ksm_current_cpu()->subverted)
+		return;
+
+	d = mm_alloc_pool(sizeof(*d));
+	if (!d)
+		return;
+
+	/* Orphaned before the DPC, nobody can read them after it.  */
+	do {
+		orphans = k->sa_orphans;
+	} while (!__cas64((volatile u64 *)&k->sa_orphans, (u64)orphans, 0));
+
+	dedup_phase(k, d, SA_DEDUP_PROTECT);
+	CALL_DPC(__sa_invept, NULL);
+	free_cow_orphans(orphans);
+
+	dedup_phase(k, d, SA_DEDUP_COLLECT);
+	if (d->nr) {
+		for (i = 0; i < d->nr; ++i)
+			d->cand[i]->hash = hash_cow_frame(d->cand[i]->hva);
+
+		dedup_phase(k, d, SA_DEDUP_LOOKUP);
+		dedup_match(d);
+	}
+
+	dedup_phase(k, d, SA_DEDUP_MERGE);
+	mm_free_pool(d, sizeof(*d));
+}
+
+#ifdef __linux__
+static struct task_struct *dedup_thread;
+
+static inline bool sandbox_reap_pending(struct ksm *k)
+{
+	return !list_empty(&k->sa_dead) || !list_empty(&k->sa_dead_members);
+}
+
+/* Runs a merge pass every SA_DEDUP_MS, and reaps exits as they come.  */
+static int sandbox_thread(void *data)
+{
+	struct ksm *k = data;
+	long left;
+
+	while (!kthread_should_stop()) {
+		left = wait_event_interruptible_timeout(sandbox_wait,
+							kthread_should_stop() ||
+							sandbox_reap_pending(k),
+							msecs_to_jiffies(SA_DEDUP_MS));
+		sandbox_reap(k);
+		if (left == 0)
+			sandbox_dedup(k);
+	}
+
+	return 0;
+}
+
+static inline int sandbox_thread_start(struct ksm *k)
+{
+	dedup_thread = kthread_run(sandbox_thread, k, "ksm_dedup");
+	if (IS_ERR(dedup_thread))
+		return PTR_ERR(dedup_thread);
+
+	return 0;
+}
+
+static inline void sandbox_thread_stop(void)
+{
+	kthread_stop(dedup_thread);
+}
+#else
+static volatile bool dedup_do_exit = false;
+static volatile bool dedup_exited = false;
+
+static void sandbox_thread(void *k)
+{
+	while (!dedup_do_exit) {
+		KeDelayExecutionThread(KernelMode, FALSE, &(LARGE_INTEGER) {
+			.QuadPart = -(10000 * SA_DEDUP_MS)
+		});
+		if (!dedup_do_exit)
+			sandbox_dedup(k);
+	}
+
+#ifdef _MSC_VER
+	InterlockedExchange8(&dedup_exited, true);
+#else
+	__sync_bool_compare_and_swap(&dedup_exited, false, true);
+#endif
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static inline int sandbox_thread_start(struct ksm *k)
+{
+	HANDLE hThread;
+	CLIENT_ID cid;
+	NTSTATUS status;
+
+	dedup_do_exit = dedup_exited = false;
+	status = PsCreateSystemThread(&hThread, STANDARD_RIGHTS_ALL,
+				      NULL, NULL, &cid,
+				      (PKSTART_ROUTINE)sandbox_thread, k);
+	if (NT_SUCCESS(status))
+		ZwClose(hThread);
+
+	return status;
+}
+
+static inline void sandbox_thread_stop(void)
+{
+#ifdef _MSC_VER
+	InterlockedExchange8(&dedup_do_exit, true);
+#else
+	__sync_bool_compare_and_swap(&dedup_do_exit, false, true);
+#endif
+	while (!dedup_exited)
+		cpu_relax();
+}
+#endif
+
+int ksm_sandbox_dedup_stats(struct ksm *k, struct ksm_sandbox_dedup *req)
+{
+	req->frames = k->sa_nr_frames;
+	req->merged = k->sa_merged;
+	req->split = k->sa_split;
+	return 0;
+}
+
+int ksm_sandbox_init(struct ksm *k)
+{
+	int ret;
+	int i;
+
+	spin_lock_init(&k->task_lock);
+	spin_lock_init(&k->frame_lock);
+	INIT_LIST_HEAD(&k->task_list);
+	INIT_LIST_HEAD(&k->sa_dead);
+	INIT_LIST_HEAD(&k->sa_dead_members);
+	for (i = 0; i < SA_HASH_SIZE; ++i)
+		k->task_pgd[i] = k->task_pid[i] = NULL;
+
+	for (i = 0; i < SA_DEDUP_SIZE; ++i)
+		k->sa_frames[i] = NULL;
+
+	k->sa_orphans = NULL;
+	k->sa_nr_frames = k->sa_merged = k->sa_split = 0;
+
+	ret = register_sched_hook(k);
+	if (ret < 0)
+		return ret;
+
+	ret = sandbox_thread_start(k);
+	if (ret < 0)
+		unregister_sched_hook(k);
+
+	return ret;
+}
+
+static struct sa_task *unlink_first_sa_task(struct ksm *k)
+{
+	struct sa_task *task = NULL;
+	struct sa_task *first = NULL;
+
+	spin_lock(&k->task_lock);
+	list_for_each_entry(task, &k->task_list, link) {
+		first = task;
+		break;
+	}
 
-	list_del(&task->link);
-	__mm_free_pool(task);
+	if (first)
+		unlink_sa_task(k, first);
+	spin_unlock(&k->task_lock);
+	return first;
 }
 
-static inline void free_sa_task(struct ksm *k, struct sa_task *task)
+/*
+ * Unbox everything, called before the CPUs are devirtualized (the views go
+ * with them), while the DPCs that take them off the views still can run.
+ * Whatever an exit probe queued meanwhile is reaped here too.
+ */
+void ksm_sandbox_unbox_all(struct ksm *k)
 {
-	CALL_DPC(__free_sa_task, task);
-	__free_sa_task(k, task);
-}
+	struct sa_task *task;
 
-int ksm_sandbox_init(struct ksm *k)
-{
-	spin_lock_init(&k->task_lock);
-	INIT_LIST_HEAD(&k->task_list);
-	return 0;
+	while ((task = unlink_first_sa_task(k)))
+		put_sa_task(k, task);
+
+	sandbox_reap(k);
 }
 
+/*
+ * Called before ksm_unsubvert() on unload, see ksm_free(), so that neither
+ * the thread nor the probes can run into a CPU that's no longer subverted.
+ */
 int ksm_sandbox_exit(struct ksm *k)
 {
-	struct sa_task *task = NULL;
-	struct sa_task *next = NULL;
-	list_for_each_entry_safe(task, next, &k->task_list, link)
-		__free_sa_task(k, task);
+	struct cow_frame *frame;
+	int i;
+
+	sandbox_thread_stop();
+	unregister_sched_hook(k);
+	ksm_sandbox_unbox_all(k);
+
+	/* Nothing references them anymore.  */
+	for (i = 0; i < SA_DEDUP_SIZE; ++i) {
+		while ((frame = k->sa_frames[i])) {
+			k->sa_frames[i] = frame->next;
+			mm_free_page(frame->hva);
+			cache_free(&frame_cache, frame);
+		}
+	}
 
+	free_cow_orphans(k->sa_orphans);
+	k->sa_orphans = NULL;
 	return 0;
 }
 
 static inline int create_sa_task(struct ksm *k, pid_t pid, u64 pgd)
 {
 	struct sa_task *task;
-	unsigned long flags;
-	int i;
+	struct sa_member *m;
+	int ret;
 
-	task = mm_alloc_pool(sizeof(*task));
-	if (!task)
+	m = cache_alloc(&member_cache);
+	if (!m)
 		return ERR_NOMEM;
 
-	task->pgd = pgd;
-	task->pid = pid;
-	INIT_LIST_HEAD(&task->pages);
-	for (i = 0; i < KSM_MAX_VCPUS; ++i)
-		task->eptp[i] = EPT_MAX_EPTP_LIST;
+	task = cache_alloc(&task_cache);
+	if (!task) {
+		cache_free(&member_cache, m);
+		return ERR_NOMEM;
+	}
 
-	spin_lock_irqsave(&k->task_lock, flags);
-	list_add(&task->link, &k->task_list);
-	spin_unlock_irqrestore(&k->task_lock, flags);
+	m->pgd = pgd;
+	m->pid = pid;
+	/* task_list's, and ours for the DPC.  */
+	task->refs = 2;
+	INIT_LIST_HEAD(&task->members);
+	task->eptp = EPT_MAX_EPTP_LIST;
+	task->fa_max = SA_FA_DEFAULT;
+	task->policy = KSM_SANDBOX_REFUSE;
+	spin_lock_init(&task->cow_lock);
+	INIT_LIST_HEAD(&task->lru);
+	INIT_LIST_HEAD(&task->limbo);
+	INIT_LIST_HEAD(&task->dedup);
+	if (__vmx_vmcall(HYPERCALL_SA_NEW, task)) {
+		cache_free(&task_cache, task);
+		cache_free(&member_cache, m);
+		return ERR_NOMEM;
+	}
+
+	/* Before anyone can be on the view.  */
+	ret = protect_user_pages(task, pid);
+	if (ret < 0) {
+		__vmx_vmcall(HYPERCALL_SA_FREE, task);
+		cache_free(&task_cache, task);
+		cache_free(&member_cache, m);
+		return ret;
+	}
+
+	spin_lock(&k->task_lock);
+	link_sa_task(k, task, m);
+	spin_unlock(&k->task_lock);
+	CALL_DPC(__new_sa_task, task);
+	put_sa_task(k, task);
 	return 0;
 }
 
-static inline struct cow_page *ksm_sandbox_copy_page(struct vcpu *vcpu,
-						     struct sa_task *task,
-						     u64 gpa)
+/*
+ * Give @page a frame of its own again, root mode only, see Note #11.
+ */
+static bool split_cow_page(struct vcpu *vcpu, struct sa_task *task,
+			   struct cow_page *page)
 {
-	char *hva;
-	char *h;
-	u64 hpa;
-	struct cow_page *page;
+	struct ksm *k = vcpu_to_ksm(vcpu);
+	struct cow_frame *frame;
+	bool ret = true;
+	void *hva;
 
-	hpa = gpa_to_hpa(vcpu, gpa, &hpa);
-	if (!hpa)
-		return false;
+	spin_lock(&task->cow_lock);
+	spin_lock(&k->frame_lock);
+	frame = page->shared;
+	if (!frame)
+		goto out;
 
-	h = mm_remap(hpa, PAGE_SIZE);
-	if (!h)
-		return false;
+	if (frame->refs == 1) {
+		/* Only us, take it back.  */
+		unhash_cow_frame(k, frame);
+		cache_free(&frame_cache, frame);
+	} else {
+		hva = vcpu_alloc_page(vcpu);
+		if (!hva) {
+			ret = false;
+			goto out;
+		}
+
+		mm_copy_page(hva, frame->hva);
+		page->hva = hva;
+		page->hpa = __pa(hva);
+		put_cow_frame(frame);
+		__xadd(&k->sa_split, 1);
+	}
+
+	page->shared = NULL;
+out:
+	spin_unlock(&k->frame_lock);
+	spin_unlock(&task->cow_lock);
+	return ret;
+}
+
+/*
+ * Copy @gpa, or @from (a frozen copy of it) if there's one.
+ */
+static struct cow_page *copy_cow_page(struct vcpu *vcpu, u64 gpa,
+				      struct cow_page *from)
+{
+	struct cow_page *page;
+	void *h;
 
-	page = mm_alloc_pool(sizeof(*page));
+	page = cache_alloc(&cow_cache);
 	if (!page)
+		return NULL;
+
+	page->hva = vcpu_alloc_page(vcpu);
+	if (!page->hva)
 		goto err_page;
 
-	hva = mm_alloc_page();
-	if (!hva)
-		goto err_cow;
+	if (from) {
+		mm_copy_page(page->hva, from->hva);
+	} else {
+		h = vcpu_map_page(vcpu, cow_origin_hpa(gpa));
+		if (!h)
+			goto err_hva;
 
-	memcpy(hva, h, PAGE_SIZE);
-	mm_unmap(h, PAGE_SIZE);
+		mm_copy_page(page->hva, h);
+		vcpu_unmap_page(vcpu, h);
+	}
 
 	page->gpa = gpa;
-	page->hpa = __pa(hva);
-	page->hva = hva;
-	list_add(&page->link, &task->pages);
+	page->hpa = __pa(page->hva);
+	INIT_LIST_HEAD(&page->dedup);
 	return page;
 
-err_cow:
-	__mm_free_pool(page);
+err_hva:
+	vcpu_free_page(vcpu, page->hva);
 err_page:
-	mm_unmap(h, PAGE_SIZE);
+	cache_free(&cow_cache, page);
 	return NULL;
 }
 
-int ksm_sandbox(struct ksm *k, pid_t pid)
+/*
+ * Find the copy of @gpa made for @task since its last snapshot, or make one,
+ * see Note #6, Note #8 and Note #10.  @force ignores limits, if NULL is
+ * returned and @retry is set, the write should just be retried later.
+ */
+static struct cow_page *get_cow_page(struct vcpu *vcpu, struct sa_task *task,
+				     u64 gpa, bool force, bool *retry)
 {
-#ifdef __linux__
-	struct pid *tsk_pid = find_vpid(pid);
-	struct task_struct *tsk;
+	struct ksm *k = vcpu_to_ksm(vcpu);
+	void *volatile *slot;
+	struct cow_page *page;
+	struct cow_page *old;
 
-	if (!tsk_pid)
-		return -EINVAL;
+	*retry = false;
+	slot = cow_slot(vcpu, task, gpa >> PAGE_SHIFT);
+	if (!slot)
+		return NULL;
 
-	tsk = pid_task(tsk_pid, PIDTYPE_PID);
-	if (!tsk)
-		return -ENOENT;
+	old = *slot;
+	if (old && old->gen == task->snap_gen) {
+		if (old->shared && !split_cow_page(vcpu, task, old))
+			return NULL;
 
-	return create_sa_task(k, pid, __pa(tsk->mm->pgd) & PAGE_PA_MASK);
-#else
-	NTSTATUS status;
-	PEPROCESS process;
-	KAPC_STATE apc;
-	uintptr_t pgd;
+		return old;
+	}
 
-	status = PsLookupProcessByProcessId((HANDLE)pid, &process);
-	if (!NT_SUCCESS(status))
-		return status;
+	if (!charge_cow_page(k, task, force) &&
+	    (task->policy != KSM_SANDBOX_RECLAIM ||
+	     !reclaim_cow_pages(vcpu, task) ||
+	     !charge_cow_page(k, task, force))) {
+		*retry = true;
+		return NULL;
+	}
+
+	KSM_DEBUG("allocating cow page for %p\n", gpa);
+	page = copy_cow_page(vcpu, gpa, old);
+	if (!page)
+		goto err;
+
+	page->gen = task->snap_gen;
+	page->frozen = old;
+
+	spin_lock(&task->cow_lock);
+	if (*slot != old) {
+		/* Someone else made it, or it was reverted meanwhile.  */
+		spin_unlock(&task->cow_lock);
+		vcpu_free_page(vcpu, page->hva);
+		cache_free(&cow_cache, page);
+		page = *slot;
+		*retry = !page;
+		goto err;
+	}
+
+	*slot = page;
+	if (old) {
+		list_del(&old->lru);
+		list_del_init(&old->dedup);
+	}
+	list_add_tail(&page->lru, &task->lru);
+	spin_unlock(&task->cow_lock);
+	return page;
+
+err:
+	uncharge_cow_pages(k, task, 1);
+	return page;
+}
+
+int ksm_sandbox(struct ksm *k, pid_t pid)
+{
+	u64 pgd;
+	int ret;
+
+	ret = get_process_pgd(pid, &pgd);
+	if (ret != 0)
+		return ret;
 
-	KeStackAttachProcess(process, &apc);
-	pgd = __readcr3() & PAGE_PA_MASK;
-	KeUnstackDetachProcess(&apc);
-	ObfDereferenceObject(process);
 	return create_sa_task(k, pid, pgd);
-#endif
 }
 
-static struct sa_task *find_sa_task(struct ksm *k, pid_t pid)
+/*
+ * Take @pid out of its group, the group goes with its last member.
+ */
+int ksm_unbox(struct ksm *k, pid_t pid)
 {
-	struct sa_task *task = NULL;
-	struct sa_task *ret = NULL;
+	struct sa_member *m;
+	bool last = false;
 
 	spin_lock(&k->task_lock);
-	list_for_each_entry(task, &k->task_list, link) {
-		if (task->pid == pid) {
-			ret = task;
-			break;
+	m = unlink_sa_pid(k, pid, &last);
+	spin_unlock(&k->task_lock);
+
+	if (!m)
+		return ERR_NOTH;
+
+	finish_unbox(k, m, last);
+	return 0;
+}
+
+/*
+ * Unbox every member of @pid's group at once.
+ */
+int ksm_unbox_group(struct ksm *k, pid_t pid)
+{
+	struct sa_task *task;
+
+	spin_lock(&k->task_lock);
+	task = find_sa_task_pid(k, pid);
+	if (task)
+		unlink_sa_task(k, task);
+	spin_unlock(&k->task_lock);
+
+	if (!task)
+		return ERR_NOTH;
+
+	put_sa_task(k, task);
+	return 0;
+}
+
+/*
+ * Add @req->pid (if not 0) to the group of @req->group, and set the group's
+ * flags to @req->flags if it's not -1, see Note #12.
+ */
+int ksm_sandbox_group(struct ksm *k, struct ksm_sandbox_group *req)
+{
+	struct sa_task *task;
+	struct sa_member *m = NULL;
+	int ret = 0;
+	u64 pgd;
+
+	if (req->flags != -1 && req->flags & ~KSM_SANDBOX_FOLLOW_FORK)
+		return ERR_UNSUP;
+
+	if (req->pid) {
+		ret = get_process_pgd(req->pid, &pgd);
+		if (ret != 0)
+			return ret;
+
+		m = cache_alloc(&member_cache);
+		if (!m)
+			return ERR_NOMEM;
+
+		m->pid = req->pid;
+		m->pgd = pgd;
+	}
+
+	spin_lock(&k->task_lock);
+	task = find_sa_task_pid(k, req->group);
+	if (!task) {
+		ret = ERR_NOTH;
+		goto out;
+	}
+
+	if (m) {
+		if (find_sa_member_pgd(k, m->pgd) || find_sa_member_pid(k, m->pid)) {
+			ret = ERR_BUSY;
+			goto out;
 		}
+
+		m->task = task;
+		link_sa_member(k, m);
+		get_sa_task(task);
 	}
+
+	if (req->flags != -1)
+		task->flags = req->flags;
+
+	req->flags = task->flags;
+out:
 	spin_unlock(&k->task_lock);
+	if (ret != 0) {
+		if (m)
+			cache_free(&member_cache, m);
+
+		return ret;
+	}
+
+	if (m) {
+		CALL_DPC(__new_sa_task, task);
+		/* It's in the group either way.  */
+		ret = protect_user_pages(task, m->pid);
+		put_sa_task(k, task);
+	}
+
 	return ret;
 }
 
-int ksm_unbox(struct ksm *k, pid_t pid)
+/*
+ * Mark a snapshot point for @pid, see Note #8.
+ */
+int ksm_sandbox_snapshot(struct ksm *k, pid_t pid)
 {
-	struct sa_task *task = NULL;
-	int ret = ERR_NOTH;
+	struct sa_task *task;
+	int ret = 0;
 
 	spin_lock(&k->task_lock);
-	list_for_each_entry(task, &k->task_list, link) {
-		if (task->pid == pid) {
-			free_sa_task(k, task);
-			ret = 0;
-			break;
-		}
-	}
+	task = find_sa_task_pid(k, pid);
+	if (task && __vmx_vmcall(HYPERCALL_SA_SNAP, task))
+		ret = ERR_NOMEM;
 	spin_unlock(&k->task_lock);
+
+	if (!task)
+		return ERR_NOTH;
+
+	CALL_DPC(__sa_invept, NULL);
 	return ret;
 }
 
-static struct sa_task *find_sa_task_pgd(struct ksm *k, u64 pgd)
+/*
+ * Throw away everything @pid wrote since its last snapshot (or since it was
+ * boxed), see Note #8.
+ */
+int ksm_sandbox_reset(struct ksm *k, pid_t pid)
 {
-	struct sa_task *task = NULL;
-	struct sa_task *ret = NULL;
+	struct sa_reset r;
+	struct cow_page *page = NULL;
+	struct cow_page *next = NULL;
+	int ret = 0;
 
+	INIT_LIST_HEAD(&r.freed);
 	spin_lock(&k->task_lock);
-	list_for_each_entry(task, &k->task_list, link) {
-		if (task->pgd == pgd) {
-			ret = task;
-			break;
-		}
-	}
+	r.task = find_sa_task_pid(k, pid);
+	if (r.task && __vmx_vmcall(HYPERCALL_SA_RESET, &r))
+		ret = ERR_NOMEM;
 	spin_unlock(&k->task_lock);
+
+	if (!r.task)
+		return ERR_NOTH;
+
+	/* Nobody may still be writing to them after this.  */
+	CALL_DPC(__sa_invept, NULL);
+	list_for_each_entry_safe(page, next, &r.freed, lru)
+		free_cow_page(page);
+
 	return ret;
 }
 
-static struct sa_task *find_sa_task_pgd_pid(struct ksm *k, pid_t pid, u64 pgd)
+/*
+ * Set @req->pid's fault-around limit to @req->max_window if it's not
+ * negative, and return its counters, see Note #9.
+ */
+int ksm_sandbox_fault_around(struct ksm *k, struct ksm_sandbox_fa *req)
 {
-	struct sa_task *task = NULL;
-	struct sa_task *ret = NULL;
+	struct sa_task *task;
+
+	if (req->max_window > SA_FA_MAX)
+		return ERR_RANGE;
 
 	spin_lock(&k->task_lock);
-	list_for_each_entry(task, &k->task_list, link) {
-		if (task->pgd == pgd || task->pid == pid) {
-			ret = task;
-			break;
-		}
+	task = find_sa_task_pid(k, req->pid);
+	if (task) {
+		if (req->max_window >= 0)
+			task->fa_max = req->max_window;
+
+		req->max_window = task->fa_max;
+		req->hits = task->fa_hits;
+		req->misses = task->fa_misses;
+		req->pages = task->fa_pages;
 	}
 	spin_unlock(&k->task_lock);
-	return ret;
+
+	return task ? 0 : ERR_NOTH;
 }
 
-static struct sa_task *__find_sa_task_eptp(struct ksm *k, u16 eptp)
+/*
+ * Update this CPU's write stream with a write by @task to @gva, and return
+ * how many pages after it should be copied ahead, see Note #9.
+ */
+static u32 fault_around_window(struct vcpu *vcpu, struct sa_task *task, u64 gva)
 {
-	struct sa_task *task = NULL;
+	u32 window = vcpu->fa_window;
 
-	list_for_each_entry(task, &k->task_list, link)
-		if (task_eptp(task) == eptp)
-			return task;
-	return NULL;
+	if (!gva) {
+		vcpu->fa_task = NULL;
+		vcpu->fa_window = 0;
+		return 0;
+	}
+
+	gva = PAGE_PA(gva);
+	if (vcpu->fa_task == task && gva == vcpu->fa_next) {
+		__xadd(&task->fa_hits, 1);
+		window = window ? window << 1 : 1;
+		if (window > task->fa_max)
+			window = task->fa_max;
+	} else {
+		if (vcpu->fa_task == task && window)
+			__xadd(&task->fa_misses, 1);
+		window = 0;
+	}
+
+	vcpu->fa_task = task;
+	vcpu->fa_window = window;
+	vcpu->fa_next = gva + (1 + (u64)window) * PAGE_SIZE;
+	return window;
+}
+
+/*
+ * Set the COW page limit (and policy) of @req->pid, or the global one if
+ * it's 0, and return its usage, see Note #10.
+ */
+int ksm_sandbox_limit(struct ksm *k, struct ksm_sandbox_limit *req)
+{
+	struct sa_task *task;
+
+	if (req->policy > KSM_SANDBOX_RECLAIM)
+		return ERR_RANGE;
+
+	if (!req->pid) {
+		if (req->max_pages >= 0)
+			k->sa_max_pages = req->max_pages;
+
+		req->max_pages = k->sa_max_pages;
+		req->pages = k->sa_pages;
+		req->peak = k->sa_peak_pages;
+		return 0;
+	}
+
+	spin_lock(&k->task_lock);
+	task = find_sa_task_pid(k, req->pid);
+	if (task) {
+		if (req->max_pages >= 0)
+			task->max_pages = req->max_pages;
+		if (req->policy >= 0)
+			task->policy = req->policy;
+
+		req->max_pages = task->max_pages;
+		req->policy = task->policy;
+		req->pages = task->nr_pages;
+		req->peak = task->peak_pages;
+	}
+	spin_unlock(&k->task_lock);
+
+	return task ? 0 : ERR_NOTH;
 }
 
-bool ksm_sandbox_handle_ept(struct ept *ept, int dpl, u64 gpa,
+bool ksm_sandbox_handle_ept(struct vcpu *vcpu, int dpl, u64 gpa,
 			    u64 gva, u64 cr3, u16 curr, u8 ar, u8 ac,
 			    bool *invd, u16 *eptp_switch)
 {
 	struct sa_task *task;
-	struct cow_page *page;
-	struct vcpu *vcpu;
+	struct cow_page *page = NULL;
+	struct cow_page *ahead[SA_FA_MAX];
+	struct ept *ept;
 	struct ksm *k;
 	u64 *epte;
+	u64 *e;
+	u64 next;
+	u32 nr_ahead = 0;
+	u32 window;
+	u32 i;
 	u16 eptp;
 	pid_t pid;
-	int i;
+	bool retry;
 
-	vcpu = container_of(ept, struct vcpu, ept);
 	k = vcpu_to_ksm(vcpu);
 
 	pid = proc_id();
 	task = find_sa_task_pgd_pid(k, pid, cr3 & PAGE_PA_MASK);
 	if (!task) {
-		/*
-		 * Crashed maybe...
-		 * Probably not a good way to detect this...  lazyness.
-		 */
+		/* Unboxed meanwhile, see Note #12 and Note #13.  */
 		*eptp_switch = EPTP_DEFAULT;
+		return true;
+	}
 
-		/* Free it  */
-		spin_lock(&k->task_lock);
-		task = __find_sa_task_eptp(k, curr);
-		WARN_ON(!task);
-
-		KSM_DEBUG("Task %p died, cleaning up\n", task);
-		if (task) {
-			/* Free per-cpu EPTP for this task  */
-			for (i = 0; i < KSM_MAX_VCPUS; ++i) {
-				if (task->eptp[i] != EPT_MAX_EPTP_LIST) {
-					vcpu = ksm_cpu_at(k, i);
-					ept = &vcpu->ept;
-					ept_free_ptr(ept, task->eptp[i]);
-				}
-			}
+	eptp = task_eptp(task);
+	BUG_ON(eptp != curr);
+	if (ac & EPT_ACCESS_WRITE) {
+		page = get_cow_page(vcpu, task, PAGE_PA(gpa), dpl == 0, &retry);
+		if (!page)
+			return retry;
+
+		window = fault_around_window(vcpu, task, gva);
+		for (i = 1; i <= window; ++i) {
+			if (!gva_to_gpa(vcpu, cr3, PAGE_PA(gva) + i * PAGE_SIZE,
+					dpl == 0 ? PAGE_PRESENT | PAGE_WRITE
+						 : PAGE_PRESENT | PAGE_WRITE | PAGE_USER,
+					&next))
+				break;
 
-			__free_sa_task(k, task);
+			ahead[nr_ahead] = get_cow_page(vcpu, task, PAGE_PA(next),
+						       false, &retry);
+			if (!ahead[nr_ahead])
+				break;
+
+			++nr_ahead;
 		}
 
-		spin_unlock(&k->task_lock);
-		return true;
+		if (nr_ahead)
+			__xadd(&task->fa_pages, nr_ahead);
 	}
 
-	eptp = task_eptp(task);
-	BUG_ON(eptp == EPT_MAX_EPTP_LIST);
+	/*
+	 * ept_handle_violation() invalidates the view on this CPU right away,
+	 * the others drop their (read-only) translations of the original page
+	 * on their next VM-exit.
+	 */
+	ept = vcpu_ept(vcpu);
+	ept_lock(ept);
+	epte = ept_split_pte(ept, curr, gpa);
+	if (epte) {
+		/*
+		 * Merged (see Note #11) or reclaimed (see Note #10) meanwhile,
+		 * the write will fault again.
+		 */
+		if (page && !page->shared && !page->dropped) {
+			page->scanned = false;
+			__set_epte_ar_pfn(epte, ar | ac, page->hpa >> PAGE_SHIFT);
+		} else if (!page) {
+			__set_epte_ar(epte, ar | ac);
+		}
 
-	epte = ept_pte(EPT4(ept, curr), gpa);
-	BUG_ON(eptp != curr);
+		for (i = 0; i < nr_ahead; ++i) {
+			if (ahead[i]->shared || ahead[i]->dropped)
+				continue;
 
-	if (ac & EPT_ACCESS_WRITE) {
-		KSM_DEBUG("allocating cow page for %p\n", gpa);
-		page = ksm_sandbox_copy_page(vcpu, task, gpa);
-		if (!page)
-			return false;
+			e = ept_split_pte(ept, curr, ahead[i]->gpa);
+			if (e) {
+				ahead[i]->scanned = false;
+				__set_epte_ar_pfn(e, ar | ac, ahead[i]->hpa >> PAGE_SHIFT);
+			}
+		}
 
-		__set_epte_ar_pfn(epte, ar | ac, page->hpa >> PAGE_SHIFT);
-		*invd = true;
-	} else {
-		__set_epte_ar(epte, ar | ac);
-		*invd = true;
+		ept_flush(ept, curr);
 	}
+	ept_unlock(ept);
+
+	if (!epte)
+		return false;
 
+	*invd = true;
 	return true;
 }
 
+#ifdef SANDBOX_VMFUNC
+/* Only if CR3-load exiting can't be turned off, see sandbox_sched_switch()  */
 void ksm_sandbox_handle_cr3(struct vcpu *vcpu, u64 cr3)
 {
-	struct ksm *k;
+}
+#else
+void ksm_sandbox_handle_cr3(struct vcpu *vcpu, u64 cr3)
+{
+	struct ksm *k = vcpu_to_ksm(vcpu);
 	struct sa_task *task;
-	u16 *eptp;
 
-	k = vcpu_to_ksm(vcpu);
 	task = find_sa_task_pgd(k, cr3 & PAGE_PA_MASK);
 	if (task) {
-		eptp = &task->eptp[cpu_nr()];
-		if (*eptp == EPT_MAX_EPTP_LIST)
-			BUG_ON(!ept_create_ptr(&vcpu->ept, EPT_ACCESS_RX, eptp));
-
 		vcpu->last_switch = task;
 		vcpu->eptp_before = vcpu_eptp_idx(vcpu);
-		vcpu_switch_root_eptp(vcpu, *eptp);
-	} else if (vcpu->last_switch) {
+		vcpu_switch_root_eptp(vcpu, task_eptp(task));
+		clear_cr3_targets(vcpu);
+		return;
+	}
+
+	if (vcpu->last_switch) {
 		vcpu_switch_root_eptp(vcpu, vcpu->eptp_before);
 		vcpu->last_switch = NULL;
 	}
+
+	if (list_empty(&k->task_list)) {
+		clear_cr3_targets(vcpu);
+		set_cr3_exiting(vcpu, false);
+		return;
+	}
+
+	add_cr3_target(vcpu, cr3);
 }
+#endif
 
 #endif
@@ -0,0 +1,232 @@
+/*
+ * ksm - a really simple and fast x64 hypervisor
+ * Copyright (C) 2016, 2017 Ahmed Samy <asamy@protonmail.com>
+ *
+ * Fixed-size object caches for small hypervisor structures.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#else
+#include <ntddk.h>
+#endif
+
+#include "ksm.h"
+#include "compiler.h"
+
+/*
+ * COW pages, sandbox tasks, page hooks, remap regions and EPT table
+ * descriptors are all small, allocated and freed very often, and some of
+ * them from VMX root mode, where mm_alloc_pool() can't be used.  Each of
+ * those types gets its own cache, which carves objects out of whole pages
+ * (taken with ksm_alloc_page(), i.e. from the vCPU reserve when in root mode)
+ * and never gives them back to the system until ksm_slab_exit().
+ *
+ * Free objects are kept in per-CPU magazines, and whatever doesn't fit there
+ * goes to a shared depot.  Both are lock-free LIFO stacks: the head is a
+ * pointer with a 16-bit generation tag stored in its upper (sign-extension)
+ * bits so that a pop racing with a pop+push of the same object fails its
+ * compare-and-swap instead of corrupting the list.  Since slab pages are
+ * never freed while the cache is alive, reading the next pointer of an
+ * object someone else just popped is harmless.
+ *
+ * A per-CPU magazine can still be used concurrently by root mode and the
+ * guest context it interrupted (or by a caller that got migrated after
+ * picking it), hence the CAS there too.
+ */
+#define SLAB_PTR_BITS		48
+#define SLAB_PTR_MASK		((1ULL << SLAB_PTR_BITS) - 1)
+#define SLAB_HDR_SIZE		CACHE_ALIGN
+
+struct slab_page {
+	struct slab_page *next;
+};
+
+static struct obj_cache *volatile cache_list;
+
+static inline void *stack_ptr(u64 head)
+{
+	/* Canonical address: sign-extend bit 47.  */
+	return (void *)(uintptr_t)((s64)(head << (64 - SLAB_PTR_BITS)) >> (64 - SLAB_PTR_BITS));
+}
+
+static inline u64 stack_head(void *ptr, u64 tag)
+{
+	return ((uintptr_t)ptr & SLAB_PTR_MASK) | (tag << SLAB_PTR_BITS);
+}
+
+static inline u64 stack_tag(u64 head)
+{
+	return (head >> SLAB_PTR_BITS) + 1;
+}
+
+static void stack_push(volatile u64 *top, void *obj)
+{
+	u64 old;
+
+	do {
+		old = *top;
+		*(void **)obj = stack_ptr(old);
+		barrier();
+	} while (!__cas64(top, old, stack_head(obj, stack_tag(old))));
+}
+
+static void *stack_pop(volatile u64 *top)
+{
+	u64 old;
+	void *obj;
+	void *next;
+
+	do {
+		old = *top;
+		obj = stack_ptr(old);
+		if (!obj)
+			return NULL;
+
+		next = *(void *volatile *)obj;
+	} while (!__cas64(top, old, stack_head(next, stack_tag(old))));
+
+	return obj;
+}
+
+static inline size_t cache_obj_size(const struct obj_cache *c)
+{
+	return (c->size + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+static void cache_register(struct obj_cache *c)
+{
+	struct obj_cache *head;
+
+	if (c->registered || !__cas32(&c->registered, 0, 1))
+		return;
+
+	do {
+		head = cache_list;
+		c->next = head;
+		barrier();
+	} while (!__cas64((volatile u64 *)&cache_list, (u64)head, (u64)c));
+}
+
+/*
+ * Carve a new page into objects, return the first one and push the rest to
+ * the depot.
+ */
+static void *cache_grow(struct obj_cache *c)
+{
+	struct slab_page *slab;
+	struct slab_page *head;
+	size_t size = cache_obj_size(c);
+	char *obj;
+	char *end;
+
+	slab = ksm_alloc_page();
+	if (!slab)
+		return NULL;
+
+	cache_register(c);
+	do {
+		head = c->slabs;
+		slab->next = head;
+		barrier();
+	} while (!__cas64((volatile u64 *)&c->slabs, (u64)head, (u64)slab));
+	__xadd(&c->nr_slabs, 1);
+
+	obj = (char *)slab + SLAB_HDR_SIZE;
+	end = (char *)slab + PAGE_SIZE;
+	for (obj += size; obj + size <= end; obj += size)
+		stack_push(&c->depot, obj);
+
+	return (char *)slab + SLAB_HDR_SIZE;
+}
+
+/*
+ * Allocate a zeroed object from @c, can be called from VMX root mode.
+ */
+void *cache_alloc(struct obj_cache *c)
+{
+	struct obj_mag *mag = &c->mag[cpu_nr()];
+	void *obj;
+	s32 live;
+
+	obj = stack_pop(&mag->top);
+	if (obj)
+		__xadd(&mag->count, -1);
+	else if (!(obj = stack_pop(&c->depot)) && !(obj = cache_grow(c)))
+		return NULL;
+
+	memset(obj, 0, c->size);
+	live = __xadd(&c->live, 1) + 1;
+	if (live > c->peak)
+		c->peak = live;
+	return obj;
+}
+
+/*
+ * Give @obj back to @c, can be called from VMX root mode.
+ */
+void cache_free(struct obj_cache *c, void *obj)
+{
+	struct obj_mag *mag = &c->mag[cpu_nr()];
+
+	__xadd(&c->live, -1);
+	if (mag->count < CACHE_MAG_SIZE) {
+		stack_push(&mag->top, obj);
+		__xadd(&mag->count, 1);
+		return;
+	}
+
+	stack_push(&c->depot, obj);
+}
+
+/*
+ * Free all pages of @c, no object may be in use anymore, i.e. this must
+ * only be called once all CPUs are devirtualized.
+ */
+static void cache_destroy(struct obj_cache *c)
+{
+	struct slab_page *slab;
+	struct slab_page *next;
+	int i;
+
+	KSM_DEBUG("%s: %d live, %d peak, %d slabs\n",
+		  c->name, c->live, c->peak, c->nr_slabs);
+	for (slab = c->slabs; slab; slab = next) {
+		next = slab->next;
+		mm_free_page(slab);
+	}
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		c->mag[i].top = 0;
+		c->mag[i].count = 0;
+	}
+
+	c->slabs = NULL;
+	c->depot = 0;
+	c->live = c->peak = c->nr_slabs = 0;
+	c->registered = 0;
+}
+
+void ksm_slab_exit(void)
+{
+	struct obj_cache *c;
+	struct obj_cache *next;
+
+	for (c = cache_list; c; c = next) {
+		next = c->next;
+		cache_destroy(c);
+	}
+
+	cache_list = NULL;
+}
@@ -0,0 +1,156 @@
+/*
+ * ksm - a really simple and fast x64 hypervisor
+ * Copyright (C) 2016, 2017 Ahmed Samy <asamy@protonmail.com>
+ *
+ * Per-vCPU VM-exit trace rings.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef ENABLE_TRACE
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#else
+#include <ntddk.h>
+#endif
+
+#include "ksm.h"
+#include "compiler.h"
+
+/*
+ * Printing from VMX root mode is slow, and can deadlock if the exit
+ * interrupted whoever holds the console lock, so instead every VM-exit
+ * writes a fixed-size binary record into a ring owned by its vCPU, and
+ * userspace maps the rings and reads them in batches (see um/um.h for the
+ * layout).
+ *
+ * Each ring has exactly one producer (the vCPU, interrupts disabled) and one
+ * consumer, so head and tail are plain stores ordered by a barrier, there's
+ * nothing to lock or spin on.  A full ring never blocks the vCPU, the record
+ * is dropped and counted instead.
+ *
+ * Rings are allocated with struct ksm, not per virtualization, so that a
+ * mapping stays valid across unsubvert/subvert.
+ */
+static inline struct ksm_trace_rec *trace_rec(struct ksm_trace_hdr *hdr, u64 idx)
+{
+	struct ksm_trace_rec *recs = (struct ksm_trace_rec *)((u8 *)hdr + KSM_TRACE_PAGE);
+	return &recs[idx & (KSM_TRACE_RECS - 1)];
+}
+
+/*
+ * Called from VMX root mode on each exit.
+ */
+void vcpu_trace(struct vcpu *vcpu, u32 reason)
+{
+	struct ksm_trace_hdr *hdr = vcpu->trace;
+	struct ksm_trace_rec *rec;
+	u64 head = hdr->head;
+
+	/* tail is written by userspace, a bogus value only makes us drop.  */
+	if (head - hdr->tail >= KSM_TRACE_RECS) {
+		hdr->dropped++;
+		return;
+	}
+
+	rec = trace_rec(hdr, head);
+	rec->tsc = __rdtsc();
+	rec->ip = vcpu_rip(vcpu);
+	rec->qual = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
+	rec->reason = reason;
+	rec->eptp = vcpu_eptp_idx(vcpu);
+
+	/* Publish the record only once it's complete.  */
+	barrier();
+	hdr->head = head + 1;
+}
+
+#ifdef __linux__
+static inline void *trace_alloc(void)
+{
+	return vmalloc_user(KSM_TRACE_SIZE);
+}
+
+static inline void trace_free(void *ring)
+{
+	vfree(ring);
+}
+
+/*
+ * mmap() handler of the device, the offset picks the CPU, see um/um.h.
+ */
+int ksm_trace_mmap(struct ksm *k, struct vm_area_struct *vma)
+{
+	unsigned long pages = KSM_TRACE_SIZE >> PAGE_SHIFT;
+	unsigned long cpu = vma->vm_pgoff / pages;
+	void *ring;
+
+	if (vma->vm_pgoff % pages || vma->vm_end - vma->vm_start != KSM_TRACE_SIZE)
+		return -EINVAL;
+
+	if (cpu >= KSM_MAX_VCPUS)
+		return ERR_RANGE;
+
+	ring = ksm_cpu_at(k, cpu)->trace;
+	return remap_vmalloc_range(vma, ring, 0);
+}
+#else
+static inline void *trace_alloc(void)
+{
+	return mm_alloc_pool(KSM_TRACE_SIZE);
+}
+
+static inline void trace_free(void *ring)
+{
+	mm_free_pool(ring, KSM_TRACE_SIZE);
+}
+#endif
+
+void ksm_trace_exit(struct ksm *k)
+{
+	struct vcpu *vcpu;
+	struct ksm_trace_hdr *hdr;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		vcpu = ksm_cpu_at(k, i);
+		hdr = vcpu->trace;
+		if (!hdr)
+			continue;
+
+		if (hdr->dropped)
+			KSM_DEBUG("trace: cpu %d dropped %lld records\n", i, hdr->dropped);
+
+		trace_free(hdr);
+		vcpu->trace = NULL;
+	}
+}
+
+int ksm_trace_init(struct ksm *k)
+{
+	struct vcpu *vcpu;
+	int i;
+
+	for (i = 0; i < KSM_MAX_VCPUS; ++i) {
+		vcpu = ksm_cpu_at(k, i);
+		vcpu->trace = trace_alloc();
+		if (!vcpu->trace) {
+			ksm_trace_exit(k);
+			return ERR_NOMEM;
+		}
+	}
+
+	return 0;
+}
+#endif
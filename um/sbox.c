@@ -0,0 +1,283 @@
+/*
+ * Exercises PMEM_SANDBOX end to end (Linux only), needs the driver loaded:
+ * a child is boxed, writes, is snapshot and reset, runs into a reclaiming
+ * COW limit, then exits, and after each step the parent checks what the
+ * child sees and what the driver reports.  Run as root, on an otherwise
+ * idle sandbox (the global page count is checked too).
+ *
+ * Exits with 0 if everything passed.
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "um.h"
+
+#define PAGE			4096
+#define NR_PAGES		64
+
+/* Pages of the child's buffer  */
+#define W_LO			0	/* written, snapshot and reset  */
+#define W_HI			16
+#define CLEAN_LO		16	/* rewritten with what they had  */
+#define CLEAN_HI		48
+#define RECLAIM_LO		48	/* written once the limit is set  */
+#define RECLAIM_HI		64
+
+#define REPLY_TIMEOUT_MS	10000
+#define REAP_TIMEOUT_MS		1000
+
+struct cmd {
+	char op;		/* 'f'ill, 'c'heck or 'q'uit  */
+	char c;
+	int lo;
+	int hi;
+};
+
+static int dev;
+static int to_child;
+static int from_child;
+static int failed;
+
+#define CHECK(cond, ...) do {				\
+	if (!(cond)) {					\
+		printf("FAIL %s:%d: ", __func__, __LINE__);	\
+		printf(__VA_ARGS__);			\
+		printf("\n");				\
+		++failed;				\
+	}						\
+} while (0)
+
+static void child(int in, int out)
+{
+	unsigned char *buf;
+	struct cmd cmd;
+	char ret;
+	int i;
+
+	buf = mmap(NULL, NR_PAGES * PAGE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED)
+		exit(1);
+
+	memset(buf, 'A', NR_PAGES * PAGE);
+	ret = 0;
+	if (write(out, &ret, 1) != 1)
+		exit(1);
+
+	while (read(in, &cmd, sizeof(cmd)) == sizeof(cmd)) {
+		ret = 0;
+		switch (cmd.op) {
+		case 'f':
+			memset(buf + cmd.lo * PAGE, cmd.c, (cmd.hi - cmd.lo) * PAGE);
+			break;
+		case 'c':
+			for (i = cmd.lo * PAGE; i < cmd.hi * PAGE; ++i) {
+				if (buf[i] != (unsigned char)cmd.c) {
+					ret = 1;
+					break;
+				}
+			}
+			break;
+		case 'q':
+			exit(0);
+		}
+
+		if (write(out, &ret, 1) != 1)
+			exit(1);
+	}
+
+	exit(1);
+}
+
+/* Returns what the child replied, -1 if it didn't.  */
+static int child_do(char op, char c, int lo, int hi)
+{
+	struct cmd cmd = { .op = op, .c = c, .lo = lo, .hi = hi };
+	struct pollfd pfd = { .fd = from_child, .events = POLLIN };
+	char ret;
+
+	if (write(to_child, &cmd, sizeof(cmd)) != sizeof(cmd))
+		return -1;
+
+	if (poll(&pfd, 1, REPLY_TIMEOUT_MS) != 1 ||
+	    read(from_child, &ret, 1) != 1)
+		return -1;
+
+	return ret;
+}
+
+static int get_limit(int pid, struct ksm_sandbox_limit *l)
+{
+	l->pid = pid;
+	l->policy = -1;
+	l->max_pages = -1;
+	return ioctl(dev, KSM_IOCTL_SANDBOX_LIMIT, l);
+}
+
+static void test_write(int pid)
+{
+	struct ksm_sandbox_fa fa = { .pid = pid, .max_window = 8 };
+	struct ksm_sandbox_limit l;
+
+	CHECK(ioctl(dev, KSM_IOCTL_FAULT_AROUND, &fa) == 0, "fault-around: %d", errno);
+	CHECK(child_do('f', 'B', W_LO, W_HI) == 0, "write");
+	CHECK(child_do('c', 'B', W_LO, W_HI) == 0, "written pages don't read back");
+	CHECK(child_do('c', 'A', CLEAN_LO, RECLAIM_HI) == 0, "other pages changed");
+
+	CHECK(get_limit(pid, &l) == 0, "limit: %d", errno);
+	CHECK(l.pages >= W_HI - W_LO, "%u COW pages for %d written", l.pages, W_HI - W_LO);
+
+	fa.max_window = -1;
+	CHECK(ioctl(dev, KSM_IOCTL_FAULT_AROUND, &fa) == 0, "fault-around: %d", errno);
+	CHECK(fa.hits > 0, "no fault-around hits for a sequential write");
+	printf("write: %u COW pages, fault-around %u hits %u misses %u pages\n",
+	       l.pages, fa.hits, fa.misses, fa.pages);
+}
+
+static void test_snapshot(int pid)
+{
+	CHECK(ioctl(dev, KSM_IOCTL_SNAPSHOT, &pid) == 0, "snapshot: %d", errno);
+	CHECK(child_do('f', 'C', W_LO, W_HI) == 0, "write");
+	CHECK(child_do('c', 'C', W_LO, W_HI) == 0, "written pages don't read back");
+
+	CHECK(ioctl(dev, KSM_IOCTL_RESET, &pid) == 0, "reset: %d", errno);
+	CHECK(child_do('c', 'B', W_LO, W_HI) == 0, "reset didn't go back to the snapshot");
+	CHECK(child_do('c', 'A', CLEAN_LO, RECLAIM_HI) == 0, "reset changed other pages");
+}
+
+static void test_reclaim(int pid)
+{
+	struct ksm_sandbox_limit l;
+	unsigned int max;
+
+	/* Copies that are the same as what they were copied from.  */
+	CHECK(child_do('f', 'A', CLEAN_LO, CLEAN_HI) == 0, "write");
+	CHECK(get_limit(pid, &l) == 0, "limit: %d", errno);
+
+	max = l.pages;
+	l.max_pages = max;
+	l.policy = KSM_SANDBOX_RECLAIM;
+	CHECK(ioctl(dev, KSM_IOCTL_SANDBOX_LIMIT, &l) == 0, "limit: %d", errno);
+
+	/* Only fits by dropping clean copies, never written ones.  */
+	CHECK(child_do('f', 'D', RECLAIM_LO, RECLAIM_HI) == 0, "write stalled over the limit");
+	CHECK(child_do('c', 'D', RECLAIM_LO, RECLAIM_HI) == 0, "written pages don't read back");
+	CHECK(child_do('c', 'B', W_LO, W_HI) == 0, "a written page was reclaimed");
+	CHECK(child_do('c', 'A', CLEAN_LO, CLEAN_HI) == 0, "a reclaimed page changed");
+
+	CHECK(get_limit(pid, &l) == 0, "limit: %d", errno);
+	CHECK(l.pages <= max, "%u COW pages over the limit of %u", l.pages, max);
+	printf("reclaim: %u COW pages, limit %u, peak %u\n", l.pages, max, l.peak);
+
+	l.max_pages = 0;
+	l.policy = -1;
+	CHECK(ioctl(dev, KSM_IOCTL_SANDBOX_LIMIT, &l) == 0, "limit: %d", errno);
+}
+
+static void test_exit(int pid, unsigned int pages)
+{
+	struct ksm_sandbox_limit l;
+	int status;
+	int i;
+
+	/* It may be stuck in a fault if something failed before.  */
+	if (failed)
+		kill(pid, SIGKILL);
+	else
+		child_do('q', 0, 0, 0);
+
+	CHECK(waitpid(pid, &status, 0) == pid, "waitpid: %d", errno);
+
+	CHECK(get_limit(pid, &l) != 0 && errno == ENOENT, "still boxed after exit");
+
+	/* Its pages are freed by the sandbox thread, shortly after.  */
+	for (i = 0; i < REAP_TIMEOUT_MS / 10; ++i) {
+		CHECK(get_limit(0, &l) == 0, "limit: %d", errno);
+		if (l.pages == pages)
+			break;
+
+		usleep(10000);
+	}
+
+	CHECK(l.pages == pages, "%u COW pages left, %u before", l.pages, pages);
+}
+
+int main(int ac, char *av[])
+{
+	struct ksm_sandbox_limit l;
+	struct ksm_sandbox_dedup d;
+	int in[2], out[2];
+	int subverted;
+	unsigned int pages;
+	int pid;
+	char c;
+
+	dev = open(UM_DEVICE_PATH, O_RDWR);
+	if (dev < 0) {
+		perror("open");
+		return 1;
+	}
+
+	/* Fails if it's already.  */
+	subverted = ioctl(dev, KSM_IOCTL_SUBVERT, &dev) == 0;
+	if (get_limit(0, &l) != 0) {
+		perror("limit");
+		return 1;
+	}
+
+	pages = l.pages;
+	if (pipe(in) < 0 || pipe(out) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		close(in[1]);
+		close(out[0]);
+		child(in[0], out[1]);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	to_child = in[1];
+	from_child = out[0];
+	if (read(from_child, &c, 1) != 1) {
+		printf("FAIL child didn't start\n");
+		return 1;
+	}
+
+	if (ioctl(dev, KSM_IOCTL_SANDBOX, &pid) != 0) {
+		perror("sandbox");
+		kill(pid, SIGKILL);
+		return 1;
+	}
+
+	test_write(pid);
+	test_snapshot(pid);
+	test_reclaim(pid);
+	if (ioctl(dev, KSM_IOCTL_SANDBOX_DEDUP, &d) == 0)
+		printf("dedup: %u frames, %u merged, %u split\n", d.frames, d.merged, d.split);
+
+	test_exit(pid, pages);
+	if (subverted)
+		ioctl(dev, KSM_IOCTL_UNSUBVERT, &dev);
+
+	close(dev);
+	printf("%s (%d failed)\n", failed ? "FAIL" : "PASS", failed);
+	return failed != 0;
+}
@@ -13,6 +13,14 @@
 #define KSM_IOCTL_UNBOX		_IOW(KSM_DEVICE_MAGIC, 1, int)
 #define KSM_IOCTL_SUBVERT	_IOR(KSM_DEVICE_MAGIC, 2, int)
 #define KSM_IOCTL_UNSUBVERT	_IOW(KSM_DEVICE_MAGIC, 3, int)
+#define KSM_IOCTL_STATS		_IOWR(KSM_DEVICE_MAGIC, 4, struct ksm_stats_req)
+#define KSM_IOCTL_SNAPSHOT	_IOW(KSM_DEVICE_MAGIC, 5, int)
+#define KSM_IOCTL_RESET		_IOW(KSM_DEVICE_MAGIC, 6, int)
+#define KSM_IOCTL_FAULT_AROUND	_IOWR(KSM_DEVICE_MAGIC, 7, struct ksm_sandbox_fa)
+#define KSM_IOCTL_SANDBOX_LIMIT	_IOWR(KSM_DEVICE_MAGIC, 8, struct ksm_sandbox_limit)
+#define KSM_IOCTL_SANDBOX_DEDUP	_IOR(KSM_DEVICE_MAGIC, 9, struct ksm_sandbox_dedup)
+#define KSM_IOCTL_SANDBOX_GROUP	_IOWR(KSM_DEVICE_MAGIC, 10, struct ksm_sandbox_group)
+#define KSM_IOCTL_UNBOX_GROUP	_IOW(KSM_DEVICE_MAGIC, 11, int)
 #else
 #define UM_DEVICE_NAME		L"ksm"
 #define UM_DEVICE_PATH		L"\\\\.\\" UM_DEVICE_NAME
@@ -29,5 +37,148 @@
 					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 #define KSM_IOCTL_UNSUBVERT	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x803, \
 					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_STATS		(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x804, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_SNAPSHOT	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x805, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_RESET		(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x806, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_FAULT_AROUND	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x807, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_SANDBOX_LIMIT	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x808, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_SANDBOX_DEDUP	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x809, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_SANDBOX_GROUP	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x80A, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define KSM_IOCTL_UNBOX_GROUP	(ULONG)CTL_CODE(KSM_DEVICE_MAGIC, 0x80B, \
+					METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 #endif
+
+/*
+ * VM-exit statistics (ENABLE_STATS), one set per CPU, see exit.c.
+ * Bucket n of a histogram counts exits that took [2^n, 2^(n+1)) cycles, the
+ * last one also takes anything longer.
+ */
+#define KSM_STATS_REASONS	66	/* EXIT_REASON_PCOMMIT + 1  */
+#define KSM_STATS_BUCKETS	32
+
+struct ksm_exit_hist {
+	unsigned long long count;
+	unsigned long long cycles;
+	unsigned int hist[KSM_STATS_BUCKETS];
+};
+
+struct ksm_exit_stats {
+	struct ksm_exit_hist handler[KSM_STATS_REASONS];	/* exit handler, per reason  */
+	struct ksm_exit_hist irq;				/* pending IRQ injection  */
+};
+
+/* KSM_IOCTL_STATS: set cpu, get its stats back.  */
+struct ksm_stats_req {
+	int cpu;
+	int reserved;
+	struct ksm_exit_stats stats;
+};
+
+/*
+ * KSM_IOCTL_FAULT_AROUND (PMEM_SANDBOX): set pid, and max_window to change
+ * how many pages may be copied ahead of a sequential write (0 disables it,
+ * -1 leaves it alone), get its current value and the task's counters back.
+ * A hit is a write right after the previous one (or its batch), a miss a
+ * write elsewhere while a batch was open.
+ */
+struct ksm_sandbox_fa {
+	int pid;
+	int max_window;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int pages;	/* copied ahead  */
+	unsigned int reserved;
+};
+/*
+ * KSM_IOCTL_SANDBOX_LIMIT (PMEM_SANDBOX): set pid (0 for the global limit),
+ * max_pages (0 for no limit, -1 leaves it alone) and policy (-1 leaves it
+ * alone, not used for the global limit), get them back with the number of
+ * COW pages in use and the peak.  What happens to a user mode write once a
+ * limit is reached depends on the policy:
+ *	KSM_SANDBOX_REFUSE: it faults again until there's room.
+ *	KSM_SANDBOX_RECLAIM: the oldest copies that are still unchanged are
+ *			     dropped first.
+ */
+#define KSM_SANDBOX_REFUSE	0
+#define KSM_SANDBOX_RECLAIM	1
+
+struct ksm_sandbox_limit {
+	int pid;
+	int policy;
+	int max_pages;
+	unsigned int pages;
+	unsigned int peak;
+	unsigned int reserved;
+};
+
+/*
+ * KSM_IOCTL_SANDBOX_DEDUP (PMEM_SANDBOX): get the number of frames identical
+ * COW pages are merged into right now, and how many times pages were merged
+ * into one and split off one since the driver was loaded.
+ */
+struct ksm_sandbox_dedup {
+	unsigned int frames;
+	unsigned int merged;
+	unsigned int split;
+	unsigned int reserved;
+};
+
+/*
+ * KSM_IOCTL_SANDBOX_GROUP (PMEM_SANDBOX): add pid (unless it's 0) to the
+ * group of group, a boxed process, which shares its view and COW pages with
+ * it, and set the group's flags (-1 leaves them alone), get them back.  With
+ * KSM_SANDBOX_FOLLOW_FORK, processes forked off a member join the group.
+ * KSM_IOCTL_UNBOX takes one process out of its group, KSM_IOCTL_UNBOX_GROUP
+ * unboxes the whole group of a pid, the other ioctls apply to the whole group
+ * of the pid they're given.
+ */
+#define KSM_SANDBOX_FOLLOW_FORK	1
+
+struct ksm_sandbox_group {
+	int pid;
+	int group;
+	int flags;
+	int reserved;
+};
+
+/*
+ * VM-exit trace (ENABLE_TRACE, Linux only for now), one ring per CPU.  CPU n's
+ * ring is mapped by mmap()'ing KSM_TRACE_SIZE bytes of the device at offset
+ * n * KSM_TRACE_SIZE.  It starts with a header page, followed by
+ * KSM_TRACE_RECS records.
+ *
+ * The hypervisor only ever writes head (and the records before it), the
+ * consumer only ever writes tail: records [tail, head) are valid, each at
+ * index & (KSM_TRACE_RECS - 1).  Read them, then store the new tail.  When
+ * the ring is full, new records are dropped and counted in dropped.
+ */
+#define KSM_TRACE_PAGE		4096
+#define KSM_TRACE_PAGES		16
+#define KSM_TRACE_SIZE		((KSM_TRACE_PAGES + 1) * KSM_TRACE_PAGE)
+#define KSM_TRACE_RECS		(KSM_TRACE_PAGES * KSM_TRACE_PAGE / sizeof(struct ksm_trace_rec))
+
+struct ksm_trace_rec {
+	unsigned long long tsc;
+	unsigned long long ip;
+	unsigned long long qual;	/* exit qualification  */
+	unsigned int reason;
+	unsigned short eptp;		/* EPTP index at the time of exit  */
+	unsigned short reserved;
+};
+
+struct ksm_trace_hdr {
+	/* Separate cache lines, producer and consumer are on different CPUs  */
+	volatile unsigned long long head;
+	unsigned char pad0[56];
+	volatile unsigned long long tail;
+	unsigned char pad1[56];
+	volatile unsigned long long dropped;
+};
 #endif
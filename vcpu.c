@@ -33,6 +33,14 @@ static inline void init_epte(u64 *entry, int access, u64 hpa)
 #endif
 }
 
+static inline void init_epte_leaf(u64 *entry, int level, int access, u64 hpa)
+{
+	init_epte(entry, access, hpa);
+	*entry |= EPT_MT_WRITEBACK << VMX_EPT_MT_EPTE_SHIFT;
+	if (level != EPT_LEVEL_PT)
+		*entry |= PAGE_LARGE;
+}
+
 static inline u64 *ept_page_addr(u64 *pte)
 {
 	if (!pte || !(*pte & EPT_ACCESS_RWX))
@@ -41,6 +49,242 @@ static inline u64 *ept_page_addr(u64 *pte)
 	return __va(PAGE_PA(*pte));
 }
 
+/*
+ * Paging structures are shared between the EPTP views of a vCPU, e.g. the 3
+ * initial views start out pointing to the exact same tables, only their PML4
+ * differs.  Each table has a reference count (number of entries pointing to
+ * it), and a table is only copied (see ept_unshare()) when one of its entries
+ * is about to be changed in a view that does not own it exclusively.
+ *
+ * The counts are kept aside in ept->tables, hashed by physical address, so
+ * that the tables themselves stay exactly what the processor sees.  That is
+ * a fixed array of chains through the descriptors themselves, since tables
+ * come and go in VMX root mode, where nothing can be allocated but from the
+ * reserve, and a growing hash table would have to.
+ */
+struct ept_table {
+	u64 *va;
+	u64 pa;
+	int refs;
+	struct ept_table *next;
+};
+
+static inline struct ept_table **ept_table_bucket(struct ept *ept, u64 pa)
+{
+	size_t h = (size_t)(((pa >> PAGE_SHIFT) * 0x9E3779B97F4A7C15ULL) >>
+			    (64 - EPT_TABLE_HASH_BITS));
+	return &ept->tables[h];
+}
+
+static inline struct ept_table *ept_table_find(struct ept *ept, u64 pa)
+{
+	struct ept_table *t;
+
+	for (t = *ept_table_bucket(ept, pa); t; t = t->next)
+		if (t->pa == pa)
+			return t;
+
+	return NULL;
+}
+
+static inline void ept_table_hash(struct ept *ept, struct ept_table *t)
+{
+	struct ept_table **b = ept_table_bucket(ept, t->pa);
+
+	t->next = *b;
+	*b = t;
+}
+
+static inline void ept_table_unhash(struct ept *ept, struct ept_table *t)
+{
+	struct ept_table **pp;
+
+	for (pp = ept_table_bucket(ept, t->pa); *pp != t; pp = &(*pp)->next)
+		;
+	*pp = t->next;
+}
+
+/*
+ * Tables are allocated from VMX root mode most of the time (EPT violations,
+ * hypercalls), so both the tables and their descriptors come from the
+ * current vCPU's reserve once it's running, see reserve.c and slab.c.
+ */
+static DEFINE_OBJ_CACHE(table_cache, struct ept_table);
+
+static u64 *ept_table_alloc(struct ept *ept)
+{
+	struct ept_table *t;
+
+	t = cache_alloc(&table_cache);
+	if (!t)
+		return NULL;
+
+	t->va = ksm_alloc_page();
+	if (!t->va)
+		goto err_pool;
+
+	t->pa = __pa(t->va);
+	t->refs = 1;
+	ept_table_hash(ept, t);
+	return t->va;
+
+err_pool:
+	cache_free(&table_cache, t);
+	return NULL;
+}
+
+static inline void ept_table_get(struct ept *ept, u64 pa)
+{
+	struct ept_table *t = ept_table_find(ept, pa);
+	BUG_ON(!t);
+	++t->refs;
+}
+
+/*
+ * Drop a reference to the table at @pa, which lives at @level, and free it
+ * (and drop the references it holds to its own sub-tables) if it was the last
+ * one.
+ */
+static void ept_table_put(struct ept *ept, u64 pa, int level)
+{
+	struct ept_table *t;
+	u64 entry;
+	int i;
+
+	t = ept_table_find(ept, pa);
+	BUG_ON(!t);
+	if (--t->refs != 0)
+		return;
+
+	if (level > EPT_LEVEL_PT) {
+		for (i = 0; i < 512; ++i) {
+			entry = t->va[i];
+			if (entry && !(entry & PAGE_LARGE))
+				ept_table_put(ept, PAGE_PA(entry), level - 1);
+		}
+	}
+
+	ept_table_unhash(ept, t);
+	ksm_free_page(t->va);
+	cache_free(&table_cache, t);
+}
+
+/*
+ * Take a reference to each sub-table @table (at @level) points to, this is
+ * needed when @table is a fresh copy of another one.
+ */
+static void ept_table_get_children(struct ept *ept, u64 *table, int level)
+{
+	u64 entry;
+	int i;
+
+	if (level == EPT_LEVEL_PT)
+		return;
+
+	for (i = 0; i < 512; ++i) {
+		entry = table[i];
+		if (entry && !(entry & PAGE_LARGE))
+			ept_table_get(ept, PAGE_PA(entry));
+	}
+}
+
+/*
+ * Make sure the table @epte (at @level) points to is owned by this view only,
+ * copying it if it's shared.  Returns the table, or NULL if the copy could
+ * not be allocated.
+ */
+static u64 *ept_unshare(struct ept *ept, u64 *epte, int level)
+{
+	struct ept_table *t;
+	u64 *table;
+	u64 pa = PAGE_PA(*epte);
+
+	t = ept_table_find(ept, pa);
+	BUG_ON(!t);
+	if (t->refs == 1)
+		return t->va;
+
+	table = ept_table_alloc(ept);
+	if (!table)
+		return NULL;
+
+	memcpy(table, t->va, PAGE_SIZE);
+	ept_table_get_children(ept, table, level - 1);
+	__set_epte_pfn(epte, __pa(table) >> PAGE_SHIFT);
+	ept_table_put(ept, pa, level - 1);
+	return table;
+}
+
+/*
+ * Break a large (1 GB or 2 MB) leaf at @level into a table of 512 smaller
+ * leaves that map the exact same range with the same attributes, so that
+ * a single 4 KB page in it can be changed.  1 GB leaves become 2 MB leaves,
+ * which the next level down will split again if needed.
+ *
+ * The translation does not change, so no invalidation is needed here, the
+ * caller will invalidate after it modifies the 4 KB entry anyway.
+ */
+static bool ept_split_large(struct ept *ept, u64 *epte, int level)
+{
+	u64 *table;
+	u64 base;
+	u64 attr;
+	u64 size;
+	int i;
+
+	table = ept_table_alloc(ept);
+	if (!table)
+		return false;
+
+	size = ept_level_size(level - 1);
+	base = PAGE_PA(*epte);
+	attr = *epte & ~PAGE_PA_MASK;
+	if (level - 1 == EPT_LEVEL_PT)
+		attr &= ~PAGE_LARGE;
+
+	for (i = 0; i < 512; ++i)
+		table[i] = attr | (base + i * size);
+
+	init_epte(epte, EPT_ACCESS_ALL, __pa(table));
+	return true;
+}
+
+/*
+ * Walk down to the entry at @target level that maps @gpa, allocating any
+ * missing tables on the way, splitting any large leaf that is in the way and
+ * copying any table shared with another view.  The entry returned is not
+ * initialized if it was not there.
+ */
+static u64 *ept_walk_alloc(struct ept *ept, u64 *pml4, int target, u64 gpa)
+{
+	u64 *table = pml4;
+	u64 *epte;
+	u64 *sub;
+	int level;
+
+	for (level = EPT_LEVEL_PML4; level > target; --level) {
+		epte = ept_entry(table, level, gpa);
+		if (*epte & PAGE_LARGE && !ept_split_large(ept, epte, level))
+			return NULL;
+
+		if (ept_page_addr(epte)) {
+			sub = ept_unshare(ept, epte, level);
+			if (!sub)
+				return NULL;
+		} else {
+			sub = ept_table_alloc(ept);
+			if (!sub)
+				return NULL;
+
+			init_epte(epte, EPT_ACCESS_ALL, __pa(sub));
+		}
+
+		table = sub;
+	}
+
+	return ept_entry(table, target, gpa);
+}
+
 /*
  * Sets up page tables for the required guest physical address, aka AMD64 page
  * tables, which are ugly and can be confusing, so here's an explanation of what
@@ -71,104 +315,256 @@ static inline u64 *ept_page_addr(u64 *pte)
  * And since each of those entries contain a physical address, we need to use
  * ept_page_addr() to obtain the virtual address for that specific table.
  *
+ * A PDPT or PDT entry can also be a leaf itself (PAGE_LARGE set), mapping
+ * 1 GB or 2 MB directly, that's how the identity map is built, see
+ * setup_pml4().  If such a leaf covers @gpa, it is split on the way down, see
+ * ept_split_large().
+ *
  * We currently just do a 1:1 mapping, except for the executable page
  * redirection case, see:
  *	page.c.
  */
-u64 *ept_alloc_page(u64 *pml4, int access, u64 gpa, u64 hpa)
+static u64 *__ept_alloc_page(struct ept *ept, u64 *pml4, int access, u64 gpa, u64 hpa)
 {
-	/* PML4 (512 GB) */
-	u64 *pml4e = &pml4[__pxe_idx(gpa)];
-	u64 *pdpt = ept_page_addr(pml4e);
+	u64 *page = ept_walk_alloc(ept, pml4, EPT_LEVEL_PT, gpa);
+	if (!page)
+		return NULL;
 
-	if (!pdpt) {
-		pdpt = mm_alloc_page();
-		if (!pdpt)
-			return NULL;
+	init_epte_leaf(page, EPT_LEVEL_PT, access, hpa);
+	return page;
+}
 
-		init_epte(pml4e, EPT_ACCESS_ALL, __pa(pdpt));
+u64 *ept_alloc_page(struct ept *ept, u16 eptp, int access, u64 gpa, u64 hpa)
+{
+	u64 *page;
+	u64 old;
+
+	ept_lock(ept);
+	page = ept_walk_alloc(ept, EPT4(ept, eptp), EPT_LEVEL_PT, gpa);
+	if (page) {
+		old = *page;
+		init_epte_leaf(page, EPT_LEVEL_PT, access, hpa);
+
+		/* Nothing to invalidate if it wasn't present or didn't change.  */
+		if (old & EPT_AR_MASK && old != *page)
+			ept_flush(ept, eptp);
 	}
+	ept_unlock(ept);
+	return page;
+}
 
-	/* PDPT (1 GB)  */
-	u64 *pdpte = &pdpt[__ppe_idx(gpa)];
-	u64 *pdt = ept_page_addr(pdpte);
-	if (!pdt) {
-		pdt = mm_alloc_page();
-		if (!pdt)
-			return NULL;
+/*
+ * Same as ept_pte() but splits any large leaf covering @gpa and copies any
+ * table on the way that is shared with other views, so that the entry
+ * returned maps exactly the 4 KB page @gpa is in, and only in @eptp.  Use this
+ * instead of ept_pte() whenever the entry is going to be modified.
+ */
+u64 *ept_split_pte(struct ept *ept, u16 eptp, u64 gpa)
+{
+	u64 *pml4 = EPT4(ept, eptp);
+	if (!ept_pte(pml4, gpa))
+		return NULL;
 
-		init_epte(pdpte, EPT_ACCESS_ALL, __pa(pdt));
-	}
+	return ept_walk_alloc(ept, pml4, EPT_LEVEL_PT, gpa);
+}
 
-	/* PDT (2 MB)  */
-	u64 *pdte = &pdt[__pde_idx(gpa)];
-	u64 *pt = ept_page_addr(pdte);
-	if (!pt) {
-		pt = mm_alloc_page();
-		if (!pt)
-			return NULL;
+/*
+ * Same as ept_set_ar() on every page of each of @ops, in one go: the page
+ * table the cursor is in is kept across pages, so only the first page of
+ * each 2 MB range needs a walk (and a split/copy), and each view is flushed
+ * once per run of changes rather than once per page.  The caller still
+ * needs to invalidate, e.g. vcpu_invept().
+ *
+ * Pages that are not mapped, in @eptp, are left alone and counted in
+ * @skipped (they would otherwise alias whatever frame 0 is).  Returns the
+ * number of pages whose entry changed, or ERR_NOMEM if a table couldn't be
+ * split or copied, in which case the ops before it were still applied.
+ */
+int ept_set_ar_range(struct ept *ept, const struct ept_ar_op *ops, int count,
+		     int *skipped)
+{
+	const struct ept_ar_op *op;
+	u64 *pt = NULL;
+	u64 pt_base = 0;
+	u16 pt_eptp = EPT_MAX_EPTP_LIST;
+	bool dirty = false;
+	int changed = 0;
+	u64 *epte;
+	u64 old;
+	u64 gpa;
+	u64 end;
+	int i;
 
-		init_epte(pdte, EPT_ACCESS_ALL, __pa(pt));
+	*skipped = 0;
+	ept_lock(ept);
+	for (i = 0; i < count; ++i) {
+		op = &ops[i];
+		end = op->gpa + op->size;
+		for (gpa = page_align(op->gpa); gpa < end; gpa += PAGE_SIZE) {
+			if (pt && op->eptp == pt_eptp &&
+			    (gpa & ~(ept_level_size(EPT_LEVEL_PD) - 1)) == pt_base) {
+				epte = &pt[(gpa >> PAGE_SHIFT) & PTX_MASK];
+			} else {
+				if (op->eptp != pt_eptp) {
+					if (dirty)
+						ept_flush(ept, pt_eptp);
+
+					dirty = false;
+					pt_eptp = op->eptp;
+				}
+
+				pt = NULL;
+				if (!ept_pte(EPT4(ept, pt_eptp), gpa)) {
+					++*skipped;
+					continue;
+				}
+
+				/* It's there, so this can only fail allocating.  */
+				epte = ept_split_pte(ept, pt_eptp, gpa);
+				if (!epte) {
+					changed = ERR_NOMEM;
+					goto out;
+				}
+
+				pt = epte - ((gpa >> PAGE_SHIFT) & PTX_MASK);
+				pt_base = gpa & ~(ept_level_size(EPT_LEVEL_PD) - 1);
+			}
+
+			old = *epte;
+			if (!(old & EPT_AR_MASK)) {
+				++*skipped;
+				continue;
+			}
+
+			__set_epte_ar(epte, op->ar);
+			if (old != *epte) {
+				dirty = true;
+				++changed;
+			}
+		}
 	}
 
-	/* PT (4 KB)  */
-	u64 *page = &pt[__pte_idx(gpa)];
-	init_epte(page, access, hpa);
+out:
+	if (dirty)
+		ept_flush(ept, pt_eptp);
+	ept_unlock(ept);
+	return changed;
+}
 
-	*page |= EPT_MT_WRITEBACK << VMX_EPT_MT_EPTE_SHIFT;
-#ifdef EPT_SUPPRESS_VE
-	*page |= EPT_SUPPRESS_VE_BIT;
-#endif
-	return page;
+/*
+ * A large leaf can only be used if every 4 KB page in it would get the same
+ * access, which is always the case for EPT_ACCESS_ALL, and otherwise decided
+ * for the range as a whole, see mm_kernel_range().
+ */
+static bool uniform_access(u64 start, u64 size, int access, int *out)
+{
+	int kernel = 1;
+
+	if (access != EPT_ACCESS_ALL)
+		kernel = mm_kernel_range(start, size);
+
+	if (kernel < 0)
+		return false;
+
+	*out = kernel ? EPT_ACCESS_ALL : access;
+	return true;
+}
+
+static inline bool ept_has_large(struct ksm *k, int level)
+{
+	if (level == EPT_LEVEL_PDPT)
+		return k->ept_cap & VMX_EPT_1GB_PAGE_BIT;
+
+	return k->ept_cap & VMX_EPT_2MB_PAGE_BIT;
 }
 
 /*
- * Recursively free each table entries, see comments above
- * ept_alloc_page() for an explanation.
+ * Map [@addr, @end) 1:1 with the largest leaf that fits (1 GB, 2 MB, then
+ * 4 KB), returns the size mapped or 0 on failure.
  */
-static void free_entries(u64 *table, int lvl)
-{
-	for (int i = 0; i < 512; ++i) {
-		u64 entry = table[i];
-		if (entry) {
-			u64 *sub_table = __va(PAGE_PA(entry));
-			if (lvl > 2)
-				free_entries(sub_table, lvl - 1);
-			else
-				mm_free_page(sub_table);
-		}
+static u64 setup_leaf(struct ept *ept, u64 *pml4, int access, u64 addr, u64 end)
+{
+	struct ksm *k = ksm;
+	u64 *epte;
+	u64 size;
+	int level;
+	int r;
+
+	for (level = EPT_LEVEL_PDPT; level > EPT_LEVEL_PT; --level) {
+		size = ept_level_size(level);
+		if ((addr & (size - 1)) || addr + size > end || !ept_has_large(k, level))
+			continue;
+
+		if (!uniform_access(addr, size, access, &r))
+			continue;
+
+		epte = ept_walk_alloc(ept, pml4, level, addr);
+		if (!epte)
+			return 0;
+
+		/* Something is already mapped in there, keep it.  */
+		if (*epte)
+			continue;
+
+		init_epte_leaf(epte, level, r, addr);
+		return size;
 	}
 
-	mm_free_page(table);
+	uniform_access(addr, PAGE_SIZE, access, &r);
+	if (!__ept_alloc_page(ept, pml4, r, addr, addr))
+		return 0;
+
+	return PAGE_SIZE;
 }
 
-static bool setup_pml4(struct ept *ept, int access, u16 eptp)
+static bool setup_pml4(struct ept *ept, int access, u64 *pml4)
 {
 	int i;
 	u64 addr;
+	u64 size;
 	u64 apic;
 	struct pmem_range *range;
 
 	for (i = 0; i < ksm->range_count; ++i) {
 		range = &ksm->ranges[i];
-		for (addr = range->start; addr < range->end; addr += PAGE_SIZE) {
-			int r = access;
-			if (mm_is_kernel_addr(__va(addr)))
-				r = EPT_ACCESS_ALL;
-
-			if (!ept_alloc_page(EPT4(ept, eptp), r, addr, addr))
+		for (addr = range->start; addr < range->end; addr += size) {
+			size = setup_leaf(ept, pml4, access, addr, range->end);
+			if (!size)
 				return false;
 		}
 	}
 
 	/* Allocate APIC page  */
 	apic = __readmsr(MSR_IA32_APICBASE) & MSR_IA32_APICBASE_BASE;
-	if (!ept_alloc_page(EPT4(ept, eptp), EPT_ACCESS_ALL, apic, apic))
+	if (!__ept_alloc_page(ept, pml4, EPT_ACCESS_ALL, apic, apic))
 		return false;
 
 	return true;
 }
 
+/*
+ * Get the pristine identity map for @access, building it the first time.
+ * Views never modify it, they just take references to its tables and
+ * copy what they change, see ept_create_ptr().
+ */
+static u64 *ept_pristine(struct ept *ept, int access)
+{
+	u64 **pml4 = &ept->pristine[access & EPT_AR_MASK];
+	if (*pml4)
+		return *pml4;
+
+	*pml4 = ept_table_alloc(ept);
+	if (!*pml4)
+		return NULL;
+
+	if (!setup_pml4(ept, access, *pml4)) {
+		ept_table_put(ept, __pa(*pml4), EPT_LEVEL_PML4);
+		*pml4 = NULL;
+	}
+
+	return *pml4;
+}
+
 static inline void setup_eptp(u64 *ptr, u64 pml4)
 {
 	*ptr ^= *ptr;
@@ -180,40 +576,64 @@ static inline void setup_eptp(u64 *ptr, u64 pml4)
 	*ptr |= (pml4 >> PAGE_SHIFT) << PAGE_SHIFT;
 }
 
+/*
+ * Create a new view: this is just a copy of the pristine PML4 for @access,
+ * the rest of the hierarchy is shared until modified.
+ */
 bool ept_create_ptr(struct ept *ept, int access, u16 *out)
 {
 	u64 **pml4;
+	u64 *pristine;
 	u16 eptp;
 
+	ept_lock(ept);
 	eptp = find_first_zero_bit(ept->ptr_bitmap, sizeof(ept->ptr_bitmap));
 	if (eptp == sizeof(ept->ptr_bitmap))
-		return false;
+		goto err;
+
+	pristine = ept_pristine(ept, access);
+	if (!pristine)
+		goto err;
 
 	pml4 = &EPT4(ept, eptp);
-	if (!(*pml4 = mm_alloc_page()))
-		return false;
+	if (!(*pml4 = ept_table_alloc(ept)))
+		goto err;
 
-	if (!setup_pml4(ept, access, eptp)) {
-		__mm_free_page(*pml4);
-		return false;
-	}
+	memcpy(*pml4, pristine, PAGE_SIZE);
+	ept_table_get_children(ept, *pml4, EPT_LEVEL_PML4);
 
 	setup_eptp(&EPTP(ept, eptp), __pa(*pml4));
 	set_bit(eptp, ept->ptr_bitmap);
+	ept_unlock(ept);
 	*out = eptp;
 	return true;
+
+err:
+	ept_unlock(ept);
+	return false;
 }
 
 void ept_free_ptr(struct ept *ept, u16 eptp)
 {
-	free_entries(EPT4(ept, eptp), 4);
+	ept_lock(ept);
+	ept_table_put(ept, __pa(EPT4(ept, eptp)), EPT_LEVEL_PML4);
 	clear_bit(eptp, ept->ptr_bitmap);
+	/* The PML4 may be reused for another view, drop cached translations.  */
+	ept_flush_all(ept);
+	ept_unlock(ept);
 }
 
 static void free_pml4_list(struct ept *ept)
 {
 	for_each_eptp(ept, i)
 		ept_free_ptr(ept, i);
+
+	for (int ar = 0; ar <= EPT_AR_MASK; ++ar) {
+		if (ept->pristine[ar]) {
+			ept_table_put(ept, __pa(ept->pristine[ar]), EPT_LEVEL_PML4);
+			ept->pristine[ar] = NULL;
+		}
+	}
 }
 
 static inline bool init_ept(struct ept *ept)
@@ -225,6 +645,8 @@ static inline bool init_ept(struct ept *ept)
 	if (!ept->ptr_list)
 		return false;
 
+	memset(ept->tables, 0, sizeof(ept->tables));
+	memset(ept->pristine, 0, sizeof(ept->pristine));
 	memset(ept->ptr_bitmap, 0, sizeof(ept->ptr_bitmap));
 	for (i = 0; i < EPTP_INIT_USED; ++i)
 		if (!ept_create_ptr(ept, EPT_ACCESS_ALL, &dontcare))
@@ -249,14 +671,45 @@ static inline void free_ept(struct ept *ept)
 		mm_free_page(ept->ptr_list);
 }
 
+#ifdef SHARED_EPT
+/*
+ * Build the EPT shared by all vCPUs, this has to be done before any of them
+ * is initialized, see ksm_subvert().
+ */
+int ksm_init_ept(struct ksm *k)
+{
+	if (k->ept.ptr_list)
+		return 0;
+
+	spin_lock_init(&k->ept.lock);
+	k->ept.gen = 0;
+	if (!init_ept(&k->ept))
+		return ERR_NOMEM;
+
+	return 0;
+}
+
+void ksm_free_ept(struct ksm *k)
+{
+	if (k->ept.ptr_list) {
+		free_ept(&k->ept);
+		k->ept.ptr_list = NULL;
+	}
+}
+#endif
+
 /*
  * Get a PTE for the specified guest physical address, this can be used
  * to get the host physical address it redirects to or redirect to it.
  *
+ * The entry returned may be a large (2 MB or 1 GB) leaf, in which case
+ * @level is set accordingly, use ept_split_pte() instead if you're going to
+ * modify it.
+ *
  * To redirect to an HPA (Host physical address):
  * \code
  *	struct ept *ept = &vcpu->ept;
- *	u64 *epte = ept_pte(EPT4(ept, EPTP_EXHOOK), gpa);
+ *	u64 *epte = ept_split_pte(ept, EPTP_EXHOOK, gpa);
  *	__set_epte_pfn(epte, hpa >> PAGE_SHIFT);
  *	__invept_all();
  * \endcode
@@ -269,32 +722,32 @@ static inline void free_ept(struct ept *ept)
  *	u64 hfn = hpa >> PAGE_SHIFT;
  * \endcode
  */
-u64 *ept_pte(u64 *pml4, u64 gpa)
+u64 *__ept_pte(u64 *pml4, u64 gpa, int *level)
 {
-	u64 *pdpt, *pdt, *pd;
-	u64 *pdpte, *pdte;
-
-	pdpt = ept_page_addr(&pml4[__pxe_idx(gpa)]);
-	if (!pdpt)
-		return 0;
-
-	pdpte = &pdpt[__ppe_idx(gpa)];
-	pdt = ept_page_addr(pdpte);
-	if (!pdt)
-		return 0;
-
-	if (*pdpte & PAGE_LARGE)
-		return pdpte;	/* 1 GB  */
+	u64 *table = pml4;
+	u64 *epte;
+	int lvl;
+
+	for (lvl = EPT_LEVEL_PML4; lvl > EPT_LEVEL_PT; --lvl) {
+		epte = ept_entry(table, lvl, gpa);
+		if (lvl != EPT_LEVEL_PML4 && *epte & PAGE_LARGE) {
+			*level = lvl;
+			return epte;	/* 1 GB or 2 MB  */
+		}
 
-	pdte = &pdt[__pde_idx(gpa)];
-	pd = ept_page_addr(pdte);
-	if (!pd)
-		return 0;
+		table = ept_page_addr(epte);
+		if (!table)
+			return 0;
+	}
 
-	if (*pdte & PAGE_LARGE)
-		return pdte;	/* 2 MB  */
+	*level = EPT_LEVEL_PT;
+	return ept_entry(table, EPT_LEVEL_PT, gpa);	/* 4 KB  */
+}
 
-	return &pd[__pte_idx(gpa)];	/* 4 KB  */
+u64 *ept_pte(u64 *pml4, u64 gpa)
+{
+	int level;
+	return __ept_pte(pml4, gpa, &level);
 }
 
 /*
@@ -314,16 +767,16 @@ static bool do_ept_violation(struct vcpu *vcpu, u64 rip, int dpl, u64 gpa,
 			     u64 gva, u64 cr3, u16 eptp, u8 ar, u8 ac,
 			     bool *invd, u16 *eptp_switch)
 {
-	struct ept *ept = &vcpu->ept;
+	struct ept *ept = vcpu_ept(vcpu);
 	if (ar == EPT_ACCESS_NONE) {
-		if (!ept_alloc_page(EPT4(ept, eptp), EPT_ACCESS_ALL, gpa, gpa))
+		if (!ept_alloc_page(ept, eptp, EPT_ACCESS_ALL, gpa, gpa))
 			return false;
 
 		return true;
 	}
 
 #ifdef EPAGE_HOOK
-	struct page_hook_info *phi = ksm_find_page(vcpu->ksm, (void *)gva);
+	struct page_hook_info *phi = ksm_find_page(vcpu_to_ksm(vcpu), (void *)gva);
 	if (phi) {
 		*eptp_switch = phi->ops->select_eptp(phi, eptp, ar, ac);
 		KSM_DEBUG("Found hooked page, switching from %d to %d\n", eptp, *eptp_switch);
@@ -332,7 +785,7 @@ static bool do_ept_violation(struct vcpu *vcpu, u64 rip, int dpl, u64 gpa,
 #endif
 
 #ifdef PMEM_SANDBOX
-	if (ksm_sandbox_handle_ept(&vcpu->ept, dpl, gpa,
+	if (ksm_sandbox_handle_ept(vcpu, dpl, gpa,
 				   gva, cr3, eptp, ar, ac,
 				   invd, eptp_switch)) {
 		if (*eptp_switch != eptp)
@@ -359,15 +812,15 @@ bool ept_handle_violation(struct vcpu *vcpu)
 	bool invd = false;
 
 	eptp = vcpu_eptp_idx(vcpu);
-	gpa = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
+	gpa = vcpu_vmcs_read64(vcpu, GUEST_PHYSICAL_ADDRESS);
 	cr3 = vmcs_read(GUEST_CR3);
 	dpl = VMX_AR_DPL(vmcs_read32(GUEST_SS_AR_BYTES));
 	gva = 0;
-	exit = vmcs_read(EXIT_QUALIFICATION);
+	exit = vcpu_vmcs_read(vcpu, EXIT_QUALIFICATION);
 	ar = (exit >> EPT_AR_SHIFT) & EPT_AR_MASK;
 	ac = exit & EPT_AR_MASK;
 	if (exit & EPT_VE_VALID_GLA)
-		gva = vmcs_read(GUEST_LINEAR_ADDRESS);
+		gva = vcpu_vmcs_read(vcpu, GUEST_LINEAR_ADDRESS);
 
 	ar_get_bits(ar, sar);
 	ar_get_bits(ac, sac);
@@ -375,7 +828,7 @@ bool ept_handle_violation(struct vcpu *vcpu)
 		   eptp, gpa, gva, ar, sar, ac, sac);
 
 	eptp_switch = eptp;
-	if (!do_ept_violation(vcpu, vcpu->ip, dpl, gpa,
+	if (!do_ept_violation(vcpu, vcpu_rip(vcpu), dpl, gpa,
 			      gva, cr3, eptp, ar, ac,
 			      &invd, &eptp_switch))
 		return false;
@@ -383,7 +836,7 @@ bool ept_handle_violation(struct vcpu *vcpu)
 	if (eptp_switch != eptp)
 		vcpu_switch_root_eptp(vcpu, eptp_switch);
 	else if (invd)
-		__invept_all();
+		vcpu_invept_view(vcpu, eptp);
 
 	return true;
 }
@@ -420,7 +873,7 @@ void __ept_handle_violation(uintptr_t cs, uintptr_t rip)
 	info->except_mask = 0;
 
 	eptp_switch = eptp;
-	if (!do_ept_violation(vcpu, vcpu->ip, cs & 3, gpa,
+	if (!do_ept_violation(vcpu, rip, cs & 3, gpa,
 			      gva, __readcr3(), eptp, ar, ac,
 			      &invd, &eptp_switch))
 		KSM_PANIC(EPT_BUGCHECK_CODE, EPT_UNHANDLED_VIOLATION, rip, gpa);
@@ -471,7 +924,7 @@ void vcpu_run(struct vcpu *vcpu, uintptr_t gsp, uintptr_t gip)
 	struct vmcs *vmcs, *vmxon;
 	struct gdtr gdtr;
 	struct gdtr *idtr = &vcpu->g_idt;
-	struct ept *ept = &vcpu->ept;
+	struct ept *ept = vcpu_ept(vcpu);
 	struct ksm *k = vcpu_to_ksm(vcpu);
 
 	u64 vmx = __readmsr(MSR_IA32_VMX_BASIC);
@@ -581,6 +1034,11 @@ void vcpu_run(struct vcpu *vcpu, uintptr_t gsp, uintptr_t gip)
 		return;
 	}
 
+#ifdef PMEM_SANDBOX
+	vm_cpuctl = ksm_sandbox_cpu_ctl(vcpu, vm_cpuctl, MSR_IA32_VMX_PROCBASED_CTLS + msr_off);
+	vcpu->cpu_ctl = vm_cpuctl;
+#endif
+
 	const u32 req_2ndctl = SECONDARY_EXEC_ENABLE_EPT | SECONDARY_EXEC_ENABLE_VPID;
 	u32 vm_2ndctl = req_2ndctl
 		| SECONDARY_EXEC_XSAVES //| SECONDARY_EXEC_UNRESTRICTED_GUEST
@@ -789,7 +1247,7 @@ void vcpu_run(struct vcpu *vcpu, uintptr_t gsp, uintptr_t gip)
 		 * This is necessary here or just before we exit the VM,
 		 * we do it both just incase.
 		 */
-		__invept_all();
+		vcpu_invept_all(vcpu);
 		__invvpid_all();
 
 		/* If all good, this goes to do_resume label in assembly.  */
@@ -830,8 +1288,14 @@ int vcpu_init(struct vcpu *vcpu)
 	vcpu->cr0_guest_host_mask = 0;
 	vcpu->cr4_guest_host_mask = X86_CR4_VMXE;
 
+#ifndef SHARED_EPT
 	if (!init_ept(&vcpu->ept))
 		return ERR_NOMEM;
+#endif
+
+	vcpu->ept_gen_ptr = &vcpu_ept(vcpu)->gen;
+	vcpu_reserve_init(vcpu);
+	vcpu_flush_gtlb(vcpu);
 
 	vcpu->idt.limit = PAGE_SIZE - 1;
 	vcpu->idt.base = (uintptr_t)mm_alloc_page();
@@ -879,7 +1343,10 @@ out_vmxon:
 out_idt:
 	mm_free_page((void *)vcpu->idt.base);
 out_ept:
+	vcpu_reserve_free(vcpu);
+#ifndef SHARED_EPT
 	free_ept(&vcpu->ept);
+#endif
 	return ERR_NOMEM;
 }
 
@@ -894,13 +1361,19 @@ void vcpu_free(struct vcpu *vcpu)
 #endif
 	mm_free_page(vcpu->vapic_page);
 	mm_free_pool(vcpu->stack, KERNEL_STACK_SIZE);
+#ifndef SHARED_EPT
 	free_ept(&vcpu->ept);
+#endif
+	vcpu_reserve_free(vcpu);
+	KSM_DEBUG("invept: %lld single, %lld all, %lld avoided\n",
+		  vcpu->invept_single, vcpu->invept_all, vcpu->invept_avoided);
 }
 
 void vcpu_switch_root_eptp(struct vcpu *vcpu, u16 index)
 {
 	u16 curr;
-	BUG_ON(!test_bit(index, (const volatile unsigned long *)vcpu->ept.ptr_bitmap));
+	struct ept *ept = vcpu_ept(vcpu);
+	BUG_ON(!test_bit(index, (const volatile unsigned long *)ept->ptr_bitmap));
 
 	if (vcpu->secondary_ctl & SECONDARY_EXEC_ENABLE_VE) {
 		/* Native  */
@@ -919,7 +1392,10 @@ void vcpu_switch_root_eptp(struct vcpu *vcpu, u16 index)
 	}
 
 	/* Update EPT pointer  */
-	vmcs_write64(EPT_POINTER, EPTP(&vcpu->ept, index));
-	/* We have to invalidate, we just switched to a new paging hierarchy  */
-	__invept_all();
+	vmcs_write64(EPT_POINTER, EPTP(ept, index));
+	/*
+	 * Cached translations are tagged by EPTP, so there is nothing to
+	 * invalidate unless some view was updated in the meantime.
+	 */
+	vcpu_invept(vcpu);
 }
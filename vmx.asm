@@ -13,6 +13,21 @@ EXTERN vcpu_run : PROC
 EXTERN vcpu_handle_exit : PROC
 EXTERN vcpu_handle_fail : PROC
 EXTERN __ept_handle_violation : PROC
+EXTERN vcpu_fast_exits : BYTE
+EXTERN vcpu_fast_irq_off : DWORD
+EXTERN vcpu_fast_gen_off : DWORD
+EXTERN vcpu_fast_gen_ptr_off : DWORD
+
+; VMCS fields and exit reasons used by the fast path, see vmx.h
+VMCS_EXIT_REASON	= 4402h
+VMCS_EXIT_INSTR_LEN	= 440ch
+VMCS_GUEST_INTR_STATE	= 4824h
+VMCS_GUEST_RIP		= 681eh
+VMCS_GUEST_RFLAGS	= 6820h
+EXIT_REASON_CPUID	= 10
+EXIT_REASON_RDTSC	= 16
+EXIT_REASON_RDTSCP	= 51
+EXIT_REASON_XSETBV	= 55
 
 KFRAME_RPL  = -56h
 KFRAME_CSR  = -54h
@@ -194,6 +209,106 @@ do_resume:
 __vmx_vminit ENDP
 
 __vmx_entrypoint PROC
+	; Fast path for exits that only need a couple of instructions run on
+	; behalf of the guest, see vcpu_fast_exits in exit.c.  Only r8 to r11
+	; are used (and saved), everything else is left as the guest had it.
+	cmp	byte ptr [vcpu_fast_exits], 0
+	je	slow_exit
+
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+
+	mov	r8d, VMCS_EXIT_REASON
+	vmread	r9, r8
+	cmp	r9d, EXIT_REASON_CPUID
+	je	fast_check
+	cmp	r9d, EXIT_REASON_RDTSC
+	je	fast_check
+	cmp	r9d, EXIT_REASON_RDTSCP
+	je	fast_check
+	cmp	r9d, EXIT_REASON_XSETBV
+	jne	fast_out
+
+fast_check:
+	; Single-stepping (#DB to inject) or in a STI/MOV SS shadow (to be
+	; cleared), leave those to vcpu_advance_rip().
+	mov	r8d, VMCS_GUEST_RFLAGS
+	vmread	r8, r8
+	test	r8d, 100h
+	jnz	fast_out
+
+	mov	r8d, VMCS_GUEST_INTR_STATE
+	vmread	r8, r8
+	test	r8d, 3
+	jnz	fast_out
+
+	; An event to inject, or EPT updates to invalidate, leave those to
+	; vcpu_handle_exit() too.  The vCPU pointer is right above what we
+	; pushed, see below.
+	mov	r10, qword ptr [rsp + 32]
+	mov	r11d, dword ptr [vcpu_fast_irq_off]
+	cmp	byte ptr [r10 + r11], 0
+	jnz	fast_out
+
+	mov	r11d, dword ptr [vcpu_fast_gen_ptr_off]
+	mov	r11, qword ptr [r10 + r11]
+	mov	r11d, dword ptr [r11]
+	mov	r8d, dword ptr [vcpu_fast_gen_off]
+	cmp	r11d, dword ptr [r10 + r8]
+	jne	fast_out
+
+	cmp	r9d, EXIT_REASON_CPUID
+	je	fast_cpuid
+	cmp	r9d, EXIT_REASON_RDTSC
+	je	fast_rdtsc
+	cmp	r9d, EXIT_REASON_RDTSCP
+	je	fast_rdtscp
+
+	xsetbv
+	jmp	fast_resume
+
+fast_cpuid:
+	mov	r9d, eax
+	cpuid
+	cmp	r9d, 1
+	jne	fast_resume
+
+	; Hide VMX, see vcpu_handle_cpuid()
+	and	ecx, 0FFFFFFDFh
+	jmp	fast_resume
+
+fast_rdtsc:
+	rdtsc
+	jmp	fast_resume
+
+fast_rdtscp:
+	rdtscp
+
+fast_resume:
+	mov	r9d, VMCS_EXIT_INSTR_LEN
+	vmread	r9, r9
+	mov	r8d, VMCS_GUEST_RIP
+	vmread	r8, r8
+	add	r8, r9
+	mov	r9d, VMCS_GUEST_RIP
+	vmwrite	r9, r8
+
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	vmresume
+	jmp	error
+
+fast_out:
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+
+slow_exit:
 	; This is the VM entry point, aka root mode.
 	; This saves guest registers (as they are untouched for now)
 	; and restores control to guest if all good, otherwise, fail.
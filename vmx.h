@@ -937,6 +937,14 @@ static inline u8 __invept_all(void)
 	return __invept(VMX_EPT_EXTENT_GLOBAL, &(invept_t) { 0, 0 });
 }
 
+static inline u8 __invept_single(u64 ptr)
+{
+	return __invept(VMX_EPT_EXTENT_CONTEXT, &(invept_t) {
+		.ptr = ptr,
+		.gpa = 0,
+	});
+}
+
 static inline u8 __invept_gpa(u64 ptr, u64 gpa)
 {
 	return __invept(VMX_EPT_EXTENT_CONTEXT, &(invept_t) {
@@ -137,6 +137,11 @@
 #define X86_CR4_PKE		_BITUL(X86_CR4_PKE_BIT)
 #endif
 
+/* Older kernels don't have this one.  */
+#ifndef X86_CR3_PCID_NOFLUSH
+#define X86_CR3_PCID_NOFLUSH		(1ULL << 63)
+#endif
+
 /* Interrupts/Exceptions */
 #define X86_TRAP_DE			0	/*  0, Divide-by-zero */
 #define X86_TRAP_DB			1	/*  1, Debug */
@@ -597,6 +602,22 @@
 #define smp_wmb() 		_mm_sfence()
 #endif
 
+/*
+ * Atomics: __cas*() return true if *p was @o and is now @n, __xadd() returns
+ * the value *p had before adding @v.
+ */
+#ifndef _MSC_VER
+#define __cas32(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define __cas64(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define __xadd(p, v)		__sync_fetch_and_add((p), (v))
+#else
+#define __cas32(p, o, n)	\
+	(InterlockedCompareExchange((volatile long *)(p), (long)(n), (long)(o)) == (long)(o))
+#define __cas64(p, o, n)	\
+	(InterlockedCompareExchange64((volatile long long *)(p), (long long)(n), (long long)(o)) == (long long)(o))
+#define __xadd(p, v)		InterlockedExchangeAdd((volatile long *)(p), (long)(v))
+#endif
+
 #ifndef _MSC_VER
 #define __writedr(dr, val)					\
 	__asm __volatile("movq	%[Val], %%dr" #dr		\